@@ -29,12 +29,22 @@
 #include <xmmintrin.h>
 #include <emmintrin.h>
 #include <smmintrin.h>
+#include <immintrin.h>
 
 #define MSRAPI extern
 
 // D E F I N E S //////////////////////////////////////////////////////
 
 #define MSR_INIT_ZBUFFER			0x1
+#define MSR_INIT_FUSED_TILES		0x2
+#define MSR_INIT_DEFERRED_FRAME		0x4		// Bin whole scenes, implies MSR_INIT_FUSED_TILES
+#define MSR_INIT_NO_AVX2			0x8		// Keep to the SSE kernels, implies MSR_INIT_NO_AVX512
+#define MSR_INIT_NO_AVX512			0x10	// Keep to the AVX2 kernels on AVX-512 CPUs
+#define MSR_INIT_VISIBILITY_BUFFER	0x20	// Shade each pixel once per frame, implies MSR_INIT_DEFERRED_FRAME
+#define MSR_INIT_UNSORTED_JOBS		0x40	// Hand out tile jobs in the order the tiles were first binned
+#define MSR_INIT_ASYNC_DRAWS		0x80	// Return from draws before the vertex stage is done, see MSR_DrawTriangles
+#define MSR_INIT_NO_TILE_SPLIT		0x100	// Keep every tile one job, however much it holds
+#define MSR_INIT_NO_EARLY_RASTER	0x200	// Wait for the whole vertex stage before rasterizing
 
 #define MSR_TRANSFORM_WORLD			0
 #define MSR_TRANSFORM_VIEW			1
@@ -55,11 +65,15 @@
 #define MSR_MAX_RENDER_TARGETS		16
 
 #define MSR_DEFAULT_RENDER_TARGET   0
+#define MSR_DEFAULT_GUARD_BAND		1024
 
 #define MSR_OK						0
 #define MSR_ERR_NULL_TARGET			-1
 #define MSR_ERR_LOW_MEMORY			-2
 #define MSR_ERR_MAX_TARGETS			-3
+#define MSR_ERR_TARGET_SIZE			-4		// Wider or taller than 16384 pixels
+#define MSR_ERR_TARGET_FORMAT		-5		// Neither 16 nor 32 bits per pixel
+#define MSR_ERR_THREAD_COUNT		-6		// No threads, or more than 256 with MSR_INIT_VISIBILITY_BUFFER
 
 // S T R U C T S //////////////////////////////////////////////////////
 
@@ -180,6 +194,53 @@ struct MSR_FShaderParameters
 	MSR_SSEColor3 output;
 };
 
+// Eight pixels at once, for the AVX2 fragment kernels
+struct MSR_FShaderOutput8
+{
+	__m256 r, g, b;
+};
+
+struct MSR_FShaderParameters8
+{
+	const MSR_ShaderGlobals *globals;
+
+	__m256 varyings[MSR_MAX_VARYINGS];
+	MSR_FShaderOutput8 output;
+};
+
+//
+// Statistics
+//
+
+struct MSR_Stats
+{
+	// Parallel batches and tile jobs processed
+	Uint32 batches;
+	Uint32 tile_jobs;
+
+	// Tiles that were heavy enough to be split into sub-tile jobs
+	Uint32 split_tiles;
+
+	// Seconds between the first and the last worker thread running out of work, summed over
+	// batches. The submitting thread moves on to the next batch and is not counted.
+	double tail_time;
+
+	// Seconds the workers spent waiting on the last one, summed over threads and batches
+	double idle_time;
+
+	// Seconds from a batch being handed out until every thread is through transforming and
+	// binning it, summed over batches. Only taken for batches drawn with more than one thread.
+	double vertex_time;
+
+	// Bytes held by the tile bins. They grow to what the busiest batch needed and are not
+	// given back, so this is the high-water mark and is not cleared by MSR_ResetStats.
+	Uint32 bin_memory;
+
+	// Triangles that reached past the guard band or through the near or far plane, and had to
+	// be clipped
+	Uint32 clipped_triangles;
+};
+
 // F U N C T I O N   P R O T O T Y P E S //////////////////////////////
 
 // Library initiation and shutdown 
@@ -189,9 +250,11 @@ MSRAPI int MSR_Quit();
 // Render Targets
 MSRAPI int MSR_CreateRenderTarget( SDL_Surface *target, Uint32 flags, Uint32 *id );
 MSRAPI void MSR_SetRenderTarget( Uint32 id );
+// Drawing goes to buffers of the target's own, the surfaces are written at MSR_EndScene and,
+// for the depth, here
 MSRAPI void MSR_GetRenderTargetDepth( Uint32 id, SDL_Surface **depth );
 
-// Render States
+// Render States. Changes apply to the draws that come after, without waiting on the ones in flight.
 MSRAPI void MSR_SetTransform( Uint32 type, const MSR_Mat4x4 &mat );
 MSRAPI void MSR_SetCullMode( Uint32 cullmode );
 MSRAPI void MSR_SetFillMode( Uint32 fillmode );
@@ -204,11 +267,23 @@ MSRAPI void MSR_SetLightingMode( Uint32 lightmode );
 MSRAPI void MSR_SetZBufferEnabled( bool on );
 MSRAPI void MSR_SetBackBufferEnabled( bool on );
 
+// Pixels past each edge of the render target that triangles may reach before they are clipped,
+// MSR_DEFAULT_GUARD_BAND to start with. The rasterizer scissors the rest. It is held to what
+// the fixed point edge functions can take at the size of the target, and 0 clips at the edges.
+MSRAPI void MSR_SetGuardBand( Uint32 pixels );
+
 // Shaders
 MSRAPI void MSR_SetNumVaryings( Uint32 varyings );
 MSRAPI void MSR_SetVertexShader( void (*vs)(MSR_VShaderParameters *params) );
 MSRAPI void MSR_SetFragmentShader( void (*fs)(MSR_FShaderParameters *params) );
 
+// Optional 8-wide version of the fragment shader, used on AVX2 CPUs. Without one the 4-wide shader
+// runs twice per span. MSR_SetFragmentShader clears it, so set it afterwards.
+MSRAPI void MSR_SetFragmentShader8( void (*fs)(MSR_FShaderParameters8 *params) );
+
+// May return before the triangles are rasterized, so that the next draw can overlap with it. The
+// vertex and index data can be reused once it returns. With MSR_INIT_ASYNC_DRAWS it returns while
+// other threads are still transforming, and the data must not change until MSR_EndScene.
 MSRAPI void MSR_DrawTriangles( MSR_Vertex *vertices, Uint32 num_vertices, Uint32 *indices, Uint32 num_indices );
 
 // Rendering
@@ -217,4 +292,8 @@ MSRAPI void MSR_Clear(Uint32 flags,Uint32 color);
 MSRAPI void MSR_EndScene();
 MSRAPI void MSR_Present();
 
+// Statistics
+MSRAPI void MSR_GetStats( MSR_Stats *stats );
+MSRAPI void MSR_ResetStats();
+
 #endif
\ No newline at end of file
@@ -30,7 +30,7 @@ enum {
 	CLIP_NEG_Z_BIT = 0x20
 };
 
-static inline void AddInterpVertex(float t, int out, int in, MSR_TransformedVertex *v, int nverts )
+static inline void AddInterpVertex(float t, int out, int in, MSR_TransformedVertex *v, int nverts, Uint32 num_varyings )
 {
 	#define LINTERP(T, OUT, IN) (OUT) + ((IN) - (OUT)) * (T)
 
@@ -43,7 +43,7 @@ static inline void AddInterpVertex(float t, int out, int in, MSR_TransformedVert
 	vout.p.z = LINTERP(t, a.p.z, b.p.z);
 	vout.p.w = LINTERP(t, a.p.w, b.p.w);
 
-	for( int i=0, n=render_context.num_varyings; i<n; i++ )
+	for( int i=0, n=num_varyings; i<n; i++ )
 		vout.varyings[i] = LINTERP(t, a.varyings[i], b.varyings[i]);
 
 	#undef LINTERP
@@ -53,13 +53,20 @@ static inline void AddInterpVertex(float t, int out, int in, MSR_TransformedVert
 
 #define CLIP_DOTPROD(I, A, B, C, D) (v[I].p.x * A + v[I].p.y * B + v[I].p.z * C + v[I].p.w * D)
 
-static inline int CalcClipMask( MSR_TransformedVertex &v )
+//
+// Planes a vertex is outside of, with the x and y planes pushed out by the guard band factors
+//
+
+static inline int CalcClipMask( MSR_TransformedVertex &v, float gx, float gy )
 {
+	float wx = gx * v.p.w;
+	float wy = gy * v.p.w;
+
 	int cmask = 0;
-	if( v.p.w - v.p.x < 0.0f ) cmask |= CLIP_POS_X_BIT;
-	if( v.p.x + v.p.w < 0.0f ) cmask |= CLIP_NEG_X_BIT;
-	if( v.p.w - v.p.y < 0.0f ) cmask |= CLIP_POS_Y_BIT;
-	if( v.p.y + v.p.w < 0.0f ) cmask |= CLIP_NEG_Y_BIT;
+	if( wx - v.p.x < 0.0f ) cmask |= CLIP_POS_X_BIT;
+	if( v.p.x + wx < 0.0f ) cmask |= CLIP_NEG_X_BIT;
+	if( wy - v.p.y < 0.0f ) cmask |= CLIP_POS_Y_BIT;
+	if( v.p.y + wy < 0.0f ) cmask |= CLIP_NEG_Y_BIT;
 	if( v.p.w - v.p.z < 0.0f ) cmask |= CLIP_POS_Z_BIT;
 	if( v.p.z + v.p.w < 0.0f ) cmask |= CLIP_NEG_Z_BIT;
 	return cmask;
@@ -68,19 +75,28 @@ static inline int CalcClipMask( MSR_TransformedVertex &v )
 #include <iostream>
 using namespace std;
 
-void ClipTriangle( MSR_TransformedVertex *v, Uint32 thread_id )
+void ClipTriangle( MSR_DrawState *state, MSR_TransformedVertex *v, Uint32 thread_id )
 {
+	// Anything entirely off one side of the screen is gone
+	if( CalcClipMask(v[0], 1.0f, 1.0f) & CalcClipMask(v[1], 1.0f, 1.0f) & CalcClipMask(v[2], 1.0f, 1.0f) )
+		return;
+
+	// Only what reaches past the guard band, or through the near or far plane, has to be clipped.
+	// The rest is rasterized as it is and scissored to the tiles.
+	float gx = state->guard_x;
+	float gy = state->guard_y;
+
 	int cmask = 0;
-	cmask |= CalcClipMask(v[0]);
-	cmask |= CalcClipMask(v[1]);
-	cmask |= CalcClipMask(v[2]);
+	cmask |= CalcClipMask(v[0], gx, gy);
+	cmask |= CalcClipMask(v[1], gx, gy);
+	cmask |= CalcClipMask(v[2], gx, gy);
 
 	if( cmask == 0 )
 	{
-		PostProcessVertex(&v[0]);
-		PostProcessVertex(&v[1]);
-		PostProcessVertex(&v[2]);
-		InsertTransformedTriangle(&v[0], &v[1], &v[2], thread_id);
+		PostProcessVertex(state, &v[0]);
+		PostProcessVertex(state, &v[1]);
+		PostProcessVertex(state, &v[2]);
+		InsertTransformedTriangle(state, &v[0], &v[1], &v[2], thread_id);
 	}
 	else 
 	{
@@ -91,11 +107,12 @@ void ClipTriangle( MSR_TransformedVertex *v, Uint32 thread_id )
 
 		// Start out with the original vertices
 		inlist[0] = 0; inlist[1] = 1; inlist[2] = 2;
+		clipped_triangles[thread_id].count++;
 
-		float planes[6][4] = { { 1,  0,  0,  1 },
-							   {-1,  0,  0,  1 },
-							   { 0,  1,  0,  1 },
-						       { 0, -1,  0,  1 },
+		float planes[6][4] = { { 1,  0,  0, gx },
+							   {-1,  0,  0, gx },
+							   { 0,  1,  0, gy },
+						       { 0, -1,  0, gy },
 						  	   { 0,  0,  1,  1 },
 					  	       { 0,  0, -1,  1 } };
 
@@ -128,12 +145,12 @@ void ClipTriangle( MSR_TransformedVertex *v, Uint32 thread_id )
 						if( dp < 0.0f ) 
 						{ 
 							float t = dp / ( dp - dpPrev ); 
-							AddInterpVertex(t, idx, idxPrev, v, nverts); 
+							AddInterpVertex(t, idx, idxPrev, v, nverts, state->context.num_varyings); 
 						} 
 						else 
 						{ 
 							float t = dpPrev / ( dpPrev - dp ); 
-							AddInterpVertex(t, idxPrev, idx, v, nverts); 
+							AddInterpVertex(t, idxPrev, idx, v, nverts, state->context.num_varyings); 
 						} 
 						outlist[outcount++] = nverts; 
 						nverts++;
@@ -152,13 +169,13 @@ void ClipTriangle( MSR_TransformedVertex *v, Uint32 thread_id )
 			}
 		}
 		
-		PostProcessVertex(&v[inlist[0]]);
-		PostProcessVertex(&v[inlist[1]]);
+		PostProcessVertex(state, &v[inlist[0]]);
+		PostProcessVertex(state, &v[inlist[1]]);
 
 		for( int i = 2; i < n; i++ )
 		{
-			PostProcessVertex(&v[inlist[i]]);
-			InsertTransformedTriangle(&v[inlist[0]], &v[inlist[i-1]], &v[inlist[i]], thread_id);	
+			PostProcessVertex(state, &v[inlist[i]]);
+			InsertTransformedTriangle(state, &v[inlist[0]], &v[inlist[i-1]], &v[inlist[i]], thread_id);	
 		}
 	}
 }
\ No newline at end of file
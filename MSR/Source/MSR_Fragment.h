@@ -25,92 +25,113 @@
 
 // D E F I N E S //////////////////////////////////////////////////////
 
-// The maximum number of fragments that a single polygon can output on a given tile
-#define MSR_FRAGMENT_POLYGON_MAX		512
+// The most fragments a single polygon can output on a tile, every 8x8 block of it in masked quads
+#define MSR_FRAGMENT_POLYGON_MAX		1024
 
-// The size of each segment of the fragment buffer, and the maximum number of segments possible.
-// Since there is the potential for all of the polygons in a tile to output fragments covering 
-// the entire tile, the amount of data we would need to allocate for this worst case scenario for 
-// all tiles is prohibitive. Instead, we will split it into segments and allocate segments of the 
-// queue as needed, thereby allowing the memory usage to reflect the needs of the application better.
-#define MSR_FRAGMENT_SEGMENT_SIZE		2048
-#define MSR_FRAGMENT_SEGMENTS			12
+// Fragments a tile job can hold. Instead of growing with the overdraw, the raster stage shades
+// what it has whenever the buffer could not take another polygon, and carries on from there.
+#define MSR_FRAGMENT_BUFFER_SIZE		4096
+
+// With MSR_INIT_FUSED_TILES the rasterizing thread shades the fragments itself whenever this many
+// have piled up, so the buffer stays in L1 instead of being written out and read back by another core.
+#define MSR_FRAGMENT_FUSED_FLUSH		256
 
 #define MSR_FRAGMENT_STATE_TILE			0
 #define MSR_FRAGMENT_STATE_BLOCK		1
 #define MSR_FRAGMENT_STATE_BLOCK_MASK	2
+#define MSR_FRAGMENT_STATE_STAMP_MASK	3		// 4x4 pixels, only made by the AVX-512 rasterizer
 
 // S T R U C T S //////////////////////////////////////////////////////
 
+// Eight bytes to a fragment. A thread never holds more than 1 << 16 faces, and fragments never
+// leave the tile of their buffer, so the corner is kept from there.
 struct MSR_Fragment 
 {
-	Uint8  state;
+	Uint16 face_idx;
 	Uint8  thread_id;
-	Uint32 face_idx;
-	Uint32 x, y;
-	Uint8  mask;
+	Uint8  state;
+	Uint8  x, y;
+
+	// Coverage of a masked quad or stamp. A block stands for mask + 1 blocks in a row, one after
+	// the other to the right.
+	Uint16 mask;
 };
 
 struct MSR_FragmentBuffer
 {
-	MSR_Fragment *buffer[MSR_FRAGMENT_SEGMENTS];
-	int segments, elements;
-	int cutoff;
+	MSR_Fragment *buffer;
+	int elements;
+
+	// Corner of the tile the fragments are in
+	Uint32 x, y;
 };
 
-inline void MSR_FragmentBufferResize( MSR_FragmentBuffer *fb )
+// The helpers are static so the AVX2 and AVX-512 units get their own copies. Shared inline
+// copies would be merged at link time, and the one kept could be built for the wider ISA.
+
+// Whether the fragments have to be shaded before the next polygon is rasterized
+static inline bool MSR_FragmentBufferFull( const MSR_FragmentBuffer *fb )
 {
-	if( fb->elements >= fb->cutoff ) {
-		
-		// Allocate another segment if we have space
-		if( fb->segments != MSR_FRAGMENT_SEGMENTS ) {
-			fb->buffer[fb->segments++] = new MSR_Fragment[MSR_FRAGMENT_SEGMENT_SIZE];
-			fb->cutoff += fb->segments * MSR_FRAGMENT_SEGMENT_SIZE;
-		}
-	}
+	return fb->elements > MSR_FRAGMENT_BUFFER_SIZE - MSR_FRAGMENT_POLYGON_MAX;
 }
 
-inline MSR_Fragment *MSR_FragmentBufferGet( MSR_FragmentBuffer *fb, int idx )
+static inline MSR_Fragment *MSR_FragmentBufferGet( MSR_FragmentBuffer *fb, int idx )
 {
-	return &fb->buffer[idx / MSR_FRAGMENT_SEGMENT_SIZE][idx % MSR_FRAGMENT_SEGMENT_SIZE];
+	return &fb->buffer[idx];
 }
 
-inline MSR_Fragment *MSR_FragmentBufferGetNext( MSR_FragmentBuffer *fb )
+static inline MSR_Fragment *MSR_FragmentBufferGetNext( MSR_FragmentBuffer *fb )
 {
-	MSR_Fragment *frag = &fb->buffer[fb->elements / MSR_FRAGMENT_SEGMENT_SIZE][fb->elements % MSR_FRAGMENT_SEGMENT_SIZE];
+	MSR_Fragment *frag = MSR_FragmentBufferGet(fb, fb->elements);
 	fb->elements++;
 	return frag;
 }
 
-inline void MSR_FragmentBufferInit( MSR_FragmentBuffer *fb )
+// Add a fragment at x, y on the screen
+static inline void MSR_FragmentBufferAdd( MSR_FragmentBuffer *fb, Uint32 state, Uint32 thread_id, Uint32 face_idx, Uint32 x, Uint32 y, Uint32 mask )
 {
-	// Initialize the fragment buffer. We set the cutoff so that we will immediately resize
-	// the buffer. The cutoff before resizing is an entire tile's worth of fragments. Since
-	// we resize between polygons, this covers all cases.
-	fb->cutoff = -MSR_FRAGMENT_POLYGON_MAX;
-	fb->elements = fb->segments = 0;
-
-	for( int i=0; i<MSR_FRAGMENT_SEGMENTS; i++ ) {
-		fb->buffer[i] = NULL;
+	MSR_Fragment *frag = MSR_FragmentBufferGetNext(fb);
+	frag->face_idx = (Uint16)face_idx;
+	frag->thread_id = (Uint8)thread_id;
+	frag->state = (Uint8)state;
+	frag->x = (Uint8)(x - fb->x);
+	frag->y = (Uint8)(y - fb->y);
+	frag->mask = (Uint16)mask;
+}
+
+// Add a whole 8x8 block, as one more of the run before it if that ends right where it starts
+static inline void MSR_FragmentBufferAddBlock( MSR_FragmentBuffer *fb, Uint32 thread_id, Uint32 face_idx, Uint32 x, Uint32 y )
+{
+	if( fb->elements ) {
+		MSR_Fragment *last = MSR_FragmentBufferGet(fb, fb->elements - 1);
+		if( last->state == MSR_FRAGMENT_STATE_BLOCK && last->face_idx == face_idx && last->thread_id == thread_id &&
+			last->y == y - fb->y && last->x + 8 * (last->mask + 1) == x - fb->x ) {
+			last->mask++;
+			return;
+		}
 	}
 
-	// Do the initial allocation
-	MSR_FragmentBufferResize( fb );
+	MSR_FragmentBufferAdd(fb, MSR_FRAGMENT_STATE_BLOCK, thread_id, face_idx, x, y, 0);
+}
+
+static inline void MSR_FragmentBufferInit( MSR_FragmentBuffer *fb )
+{
+	fb->buffer = new MSR_Fragment[MSR_FRAGMENT_BUFFER_SIZE];
+	fb->elements = 0;
+	fb->x = fb->y = 0;
 }
 
-inline void MSR_FragmentBufferDestroy( MSR_FragmentBuffer *fb )
+static inline void MSR_FragmentBufferDestroy( MSR_FragmentBuffer *fb )
 {
-	fb->elements = fb->cutoff = fb->segments = 0;
+	fb->elements = 0;
 
-	for( int i=0; i<MSR_FRAGMENT_SEGMENTS; i++ ) {
-		if( fb->buffer[i] ) {
-			delete [] fb->buffer[i];
-			fb->buffer[i] = NULL;
-		}
+	if( fb->buffer ) {
+		delete [] fb->buffer;
+		fb->buffer = NULL;
 	}
 }
 
-inline void MSR_FragmentBufferClear( MSR_FragmentBuffer *fb )
+static inline void MSR_FragmentBufferClear( MSR_FragmentBuffer *fb )
 {
 	fb->elements = 0;
 }
@@ -25,52 +25,140 @@
 #include <smmintrin.h>
 #include <cstdlib> 
 #include <malloc.h>
+#include <intrin.h>
+#include <float.h>
+#include <assert.h>
+#include <algorithm>
 
 // Rendering
 MSR_RenderContext render_context;
+bool cpu_avx2;
+bool cpu_avx512;
+bool visibility_buffer;
+
+Uint32 num_work_threads;
+bool fused_tiles;
+bool deferred_frame;
+bool sort_tile_jobs;
+bool split_hot_tiles;
+bool early_raster;
+bool async_draws;
+
+// Vertex buffers, one set per batch slot
+static MSR_TransformedVertex **vertex_buffer[MSR_BATCH_SLOTS];
+static Uint32 *vertex_buffer_size[MSR_BATCH_SLOTS];
+
+// Face buffers, one set per batch slot
+static MSR_TransformedFace **face_buffer[MSR_BATCH_SLOTS];
+
+// Bin arenas, one set per batch slot
+static MSR_BinArena *bin_arenas[MSR_BATCH_SLOTS];
+MSR_AtomicU32 bin_arena_blocks;
+
+// Vertex caches, and the draw call each thread's cache was filled by
+static MSR_VertexCacheElement **vertex_cache;
+static Uint32 *vertex_cache_draw;
+static Uint32 draw_count;
 
-// Job queue
+// Bin positions for rasterizing pieces of split tiles
+static MSR_BinCursor **raster_cursors;
 
-volatile Uint32 job_queue_start_rt;
-volatile Uint32 job_queue_start_ft;
-volatile Uint32 job_queue_end;
-volatile Uint32 num_work_threads;
+// The deferred frame being binned
+static MSR_ThreadRenderData frame_data;
 
-// Vertex buffer
-MSR_TransformedVertex **vertex_buffer;
-Uint32 *vertex_buffer_size;
+//
+// The AVX2 kernels need the CPU to support AVX2 and the OS to save the YMM registers
+//
 
-// Face buffer
-MSR_TransformedFace **face_buffer;
+static bool DetectAVX2()
+{
+	int info[4];
+	__cpuid(info, 0);
+	if( info[0] < 7 )
+		return false;
+
+	// OSXSAVE and AVX
+	__cpuid(info, 1);
+	if( ( info[2] & ( 1 << 27 ) ) == 0 || ( info[2] & ( 1 << 28 ) ) == 0 )
+		return false;
+
+	// XMM and YMM state enabled by the OS
+	if( ( _xgetbv(0) & 0x6 ) != 0x6 )
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return ( info[1] & ( 1 << 5 ) ) != 0;
+}
 
-// Vertex caches
-static MSR_VertexCacheElement **vertex_cache;
+//
+// The AVX-512 kernels use the F, DQ, BW and VL subsets and need the OS to save the opmask and
+// ZMM registers. Only asked once AVX2 is known to be there.
+//
+
+static bool DetectAVX512()
+{
+	int info[4];
+	__cpuidex(info, 7, 0);
+	const int subsets = ( 1 << 16 ) | ( 1 << 17 ) | ( 1 << 30 ) | ( 1 << 31 );
+	if( ( info[1] & subsets ) != subsets )
+		return false;
+
+	return ( _xgetbv(0) & 0xE6 ) == 0xE6;
+}
 
 int MSR_Init( SDL_Surface *screen, Uint32 flags, Uint32 num_threads )
 {
 	if( !screen ) return MSR_ERR_NULL_TARGET;
 
+	// Visibility ids have eight bits for the thread
+	visibility_buffer = ( flags & MSR_INIT_VISIBILITY_BUFFER ) != 0;
+	if( !num_threads || ( visibility_buffer && num_threads > MSR_VISIBILITY_MAX_THREADS ) ) return MSR_ERR_THREAD_COUNT;
+
 	num_work_threads = num_threads;
+	deferred_frame = visibility_buffer || ( flags & MSR_INIT_DEFERRED_FRAME ) != 0;
+
+	cpu_avx2 = !( flags & MSR_INIT_NO_AVX2 ) && DetectAVX2();
+	cpu_avx512 = cpu_avx2 && !( flags & MSR_INIT_NO_AVX512 ) && DetectAVX512();
+
+	// A deferred frame is shaded tile by tile as it is rasterized, there is no later batch to
+	// overlap a separate shading pass with.
+	fused_tiles = deferred_frame || ( flags & MSR_INIT_FUSED_TILES ) != 0;
+	sort_tile_jobs = !( flags & MSR_INIT_UNSORTED_JOBS );
+	split_hot_tiles = !( flags & MSR_INIT_NO_TILE_SPLIT );
+	early_raster = !( flags & MSR_INIT_NO_EARLY_RASTER );
+	async_draws = ( flags & MSR_INIT_ASYNC_DRAWS ) != 0;
+
+	// Create the worker threads. They sleep until the first batch, but the batch slots have to
+	// be there before anything can sync with them.
+	MSR_InitWorkerThreads();
 
 	int hr;
 	Uint32 id;
-	if( (hr = MSR_CreateRenderTarget(screen, flags, &id)) != MSR_OK ) return hr;
+	if( (hr = MSR_CreateRenderTarget(screen, flags, &id)) != MSR_OK ) {
+		MSR_DestroyWorkerThreads();
+		return hr;
+	}
 	MSR_SetRenderTarget(id);
 
-	job_queue_start_rt = job_queue_start_ft = job_queue_end	= 0;
-
 	// Allocate vertex and face buffers
-	vertex_buffer_size = new Uint32[num_threads];
-	vertex_buffer = new MSR_TransformedVertex*[num_threads];
-
-	face_buffer = new MSR_TransformedFace*[num_threads];
-
-	for( Uint32 i=0; i<num_threads; i++ )
+	for( Uint32 slot=0; slot<MSR_BATCH_SLOTS; slot++ )
 	{
-		vertex_buffer_size[i] = 0;
-		vertex_buffer[i] = (MSR_TransformedVertex*)_aligned_malloc((sizeof(MSR_TransformedVertex) * MSR_VERTEX_BUFFER_SIZE_CLIP) / num_threads, 16);
-		face_buffer[i] = new MSR_TransformedFace[MSR_VERTEX_BUFFER_SIZE_CLIP / (num_threads * 3)];
+		vertex_buffer_size[slot] = new Uint32[num_threads];
+		vertex_buffer[slot] = new MSR_TransformedVertex*[num_threads];
+		face_buffer[slot] = new MSR_TransformedFace*[num_threads];
+		bin_arenas[slot] = new MSR_BinArena[num_threads];
+
+		for( Uint32 i=0; i<num_threads; i++ )
+		{
+			vertex_buffer_size[slot][i] = 0;
+			vertex_buffer[slot][i] = (MSR_TransformedVertex*)_aligned_malloc((sizeof(MSR_TransformedVertex) * MSR_VERTEX_BUFFER_SIZE_CLIP) / num_threads, 16);
+			face_buffer[slot][i] = (MSR_TransformedFace*)_aligned_malloc(sizeof(MSR_TransformedFace) * (MSR_VERTEX_BUFFER_SIZE_CLIP / (num_threads * 3)), MSR_CACHE_LINE_SIZE);
+			bin_arenas[slot][i].first = NULL;
+			bin_arenas[slot][i].current = NULL;
+			bin_arenas[slot][i].used = 0;
+		}
 	}
+	bin_arena_blocks.store(0, std::memory_order_relaxed);
 
 	//
 	// Setup the render context
@@ -81,8 +169,10 @@ int MSR_Init( SDL_Surface *screen, Uint32 flags, Uint32 num_threads )
 	render_context.fill_mode		= MSR_FILL_SOLID;
 	render_context.depth_enabled	= true;
 	render_context.color_enabled	= true;
+	render_context.guard_band		= MSR_DEFAULT_GUARD_BAND;
 	render_context.VertexShader		= NULL;
 	render_context.FragmentShader	= NULL;
+	render_context.FragmentShader8	= NULL;
 	render_context.globals.world		= MSR_Mat4x4_Identity;
 	render_context.globals.view			= MSR_Mat4x4_Identity;
 	render_context.globals.projection	= MSR_Mat4x4_Identity;
@@ -97,14 +187,24 @@ int MSR_Init( SDL_Surface *screen, Uint32 flags, Uint32 num_threads )
 
 	// Clear out the rendering cache
 	vertex_cache = new MSR_VertexCacheElement*[num_work_threads];
+	vertex_cache_draw = new Uint32[num_work_threads];
+	draw_count = 0;
 	for( Uint32 i=0; i<num_work_threads; i++ ) {
+		vertex_cache_draw[i] = 0;
 		vertex_cache[i] = (MSR_VertexCacheElement*)_aligned_malloc(sizeof(MSR_VertexCacheElement) * MSR_VERTEX_CACHE_SIZE, 16);
 		ZeroMemory(vertex_cache[i],sizeof(MSR_VertexCacheElement)*MSR_VERTEX_CACHE_SIZE);
 		for( int j=0; j<MSR_VERTEX_CACHE_SIZE; j++ ) vertex_cache[i][j].tag = UINT_MAX;
 	}
 
-	// Create the worker threads
-	MSR_InitWorkerThreads();
+	raster_cursors = new MSR_BinCursor*[num_work_threads];
+	for( Uint32 i=0; i<num_work_threads; i++ )
+		raster_cursors[i] = new MSR_BinCursor[num_work_threads];
+
+	MSR_InitRenderData(&frame_data);
+	if( deferred_frame ) {
+		frame_data.draws = new MSR_DrawState[MSR_FRAME_MAX_DRAWS];
+		frame_data.chunk_draw = new Uint32[MSR_VERTEX_MAX_CHUNKS];
+	}
 
 	return MSR_OK;
 }
@@ -119,19 +219,39 @@ int MSR_Quit()
 		MSR_DestroyRenderTarget( i );
 
 	// Vertex and face buffers
-	for( Uint32 i=0; i<num_work_threads; i++ )
+	for( Uint32 slot=0; slot<MSR_BATCH_SLOTS; slot++ )
 	{
-		_aligned_free(vertex_buffer[i]);
-		SAFE_DELETE_ARRAY(face_buffer[i]);
-	}
+		for( Uint32 i=0; i<num_work_threads; i++ )
+		{
+			_aligned_free(vertex_buffer[slot][i]);
+			_aligned_free(face_buffer[slot][i]);
 
-	SAFE_DELETE_ARRAY(vertex_buffer_size);
+			while( MSR_BinArenaBlock *block = bin_arenas[slot][i].first ) {
+				bin_arenas[slot][i].first = block->next;
+				delete block;
+			}
+		}
+
+		SAFE_DELETE_ARRAY(vertex_buffer[slot]);
+		SAFE_DELETE_ARRAY(face_buffer[slot]);
+		SAFE_DELETE_ARRAY(vertex_buffer_size[slot]);
+		SAFE_DELETE_ARRAY(bin_arenas[slot]);
+	}
 	
 	// Clean up vertex cache
 	for( Uint32 i=0; i<num_work_threads; i++ ) 
 		_aligned_free(vertex_cache[i]);
 
 	SAFE_DELETE_ARRAY( vertex_cache );
+	SAFE_DELETE_ARRAY( vertex_cache_draw );
+
+	for( Uint32 i=0; i<num_work_threads; i++ )
+		SAFE_DELETE_ARRAY(raster_cursors[i]);
+	SAFE_DELETE_ARRAY( raster_cursors );
+
+	MSR_DestroyRenderData(&frame_data);
+	SAFE_DELETE_ARRAY( frame_data.draws );
+	SAFE_DELETE_ARRAY( frame_data.chunk_draw );
 
 	return 0;
 }
@@ -148,7 +268,7 @@ inline void CopyVertex( MSR_TransformedVertex *dst, MSR_TransformedVertex *src )
 #undef COPY
 }
 
-void GetTransformedVertex(Uint32 thread_id,MSR_Vertex *vertices, Uint32 idx, MSR_TransformedVertex *v_trans) 
+void GetTransformedVertex(MSR_DrawState *state, Uint32 thread_id,MSR_Vertex *vertices, Uint32 idx, MSR_TransformedVertex *v_trans) 
 {
 	_mm_prefetch((const char*)&vertices[idx], _MM_HINT_T0);
 
@@ -161,11 +281,11 @@ void GetTransformedVertex(Uint32 thread_id,MSR_Vertex *vertices, Uint32 idx, MSR
 		cache_item.tag = idx;
 
 		MSR_VShaderParameters params;
-		params.globals = &render_context.globals;
+		params.globals = &state->context.globals;
 		params.v_in = &vertices[idx];
 		params.v_out = v_trans;
 
-		render_context.VertexShader(&params);
+		state->context.VertexShader(&params);
 		CopyVertex(&cache_item.v, params.v_out);
 	}
 }
@@ -183,7 +303,189 @@ static inline void compute_gradient( float C,
 	dy = -B/C;
 }
 
-void InsertTransformedTriangle(MSR_TransformedVertex *v0, MSR_TransformedVertex *v1, MSR_TransformedVertex *v2, Uint32 thread_id)
+//
+// Rough cost of rasterizing a partially covered face in a tile
+//
+
+static inline Uint32 EstimateTileCost( const MSR_TransformedFace *face, const MSR_Tile &tile )
+{
+	int x0 = max( face->minx >> 4, (int)tile.x );
+	int x1 = min( face->maxx >> 4, (int)tile.x + tile.width );
+	int y0 = max( face->miny >> 4, (int)tile.y );
+	int y1 = min( face->maxy >> 4, (int)tile.y + tile.height );
+
+	return MSR_TILE_COST_SETUP + ( ((x1 - x0 + 1) * (y1 - y0 + 1)) >> 7 );
+}
+
+//
+// Take a bin chunk from a thread's arena, growing it if it has run out
+//
+
+static MSR_BinChunk *AllocBinChunk( MSR_BinArena *arena )
+{
+	if( !arena->current || arena->used == MSR_BIN_ARENA_BLOCK ) 
+	{
+		MSR_BinArenaBlock *next = arena->current ? arena->current->next : arena->first;
+		if( !next ) {
+			next = new MSR_BinArenaBlock;
+			next->next = NULL;
+			if( arena->current ) 
+				arena->current->next = next;
+			else 
+				arena->first = next;
+			bin_arena_blocks.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		arena->current = next;
+		arena->used = 0;
+	}
+
+	return &arena->current->chunks[ arena->used++ ];
+}
+
+//
+// Hand all chunks of a slot's arenas out again. Nothing may be binned in the slot.
+//
+
+static void RewindBinArenas( MSR_BinArena *arenas )
+{
+	for( Uint32 i=0; i<num_work_threads; i++ ) {
+		arenas[i].current = NULL;
+		arenas[i].used = 0;
+	}
+}
+
+//
+// Put a face into this thread's bin for a tile. The first face a thread bins in a tile may be
+// the first of the batch, so only then do we have to go and look at the tile's count. A chunk
+// is linked in before the size that covers it is published.
+//
+
+static inline void BinFace( MSR_DrawState *state, const MSR_TransformedFace *face, Uint32 face_idx, Uint32 tile_idx, Uint8 accept, Uint32 thread_id )
+{
+	// Must fit a visibility id without making it MSR_VISIBILITY_NONE
+	assert( !visibility_buffer || ( face_idx < MSR_VISIBILITY_MAX_FACES && thread_id < MSR_VISIBILITY_MAX_THREADS ) );
+
+	// Nothing of the face can show where the tile is covered by something nearer
+	if( state->context.depth_enabled && state->target->hiz_tiles && face->near_w < MSR_HiZLoad(state->target->hiz_tiles[tile_idx]) )
+		return;
+
+	MSR_Tile &tile = state->bins->tiles[tile_idx];
+	MSR_TileBin &bin = state->bins->thread_bins[ thread_id ][ tile_idx ];
+	Uint32 bin_size = bin.size.load(std::memory_order_relaxed);
+	Uint32 offset = bin_size & (MSR_BIN_CHUNK_SIZE - 1);
+
+	if( !offset ) {
+		MSR_BinChunk *chunk = AllocBinChunk( &state->bin_arenas[ thread_id ] );
+		chunk->next = NULL;
+		if( bin_size ) 
+			bin.tail->next = chunk;
+		else 
+			bin.head = chunk;
+		bin.tail = chunk;
+	}
+
+	bin.tail->faces[offset] = accept ? (face_idx | MSR_BIN_ACCEPT) : face_idx;
+	bin.cost += accept ? MSR_TILE_COST_ACCEPT : EstimateTileCost( face, tile );
+	bin.size.store(bin_size + 1, std::memory_order_release);
+
+	if( !bin_size && tile.dirty.fetch_add(1, std::memory_order_relaxed) == 0 ) {
+		Uint32 job_idx = state->bins->job_queue_end.fetch_add(1, std::memory_order_relaxed);
+		state->bins->job_queue[job_idx] = tile_idx; 
+	}
+}
+
+// Shift from a tile index to its corner in 28.4 fixed point
+#define TILE_FP_SHIFT	(MSR_SCREEN_TILE_SIZE_SHIFT + 4)
+
+static inline int EdgeAt( const MSR_EdgeSetup &edges, Uint32 e, int x, int y )
+{
+	return MSR_EdgeAt( edges.c[e], edges.dx[e], edges.dy[e], x, y );
+}
+
+//
+// An edge at the four corners of a rectangle, in the order EdgeMask gives them bits
+//
+
+static inline __m128i EdgeCorners( const MSR_EdgeSetup &edges, Uint32 e, int x0, int y0, int x1, int y1 )
+{
+	return _mm_setr_epi32( EdgeAt(edges, e, x0, y0), EdgeAt(edges, e, x1, y0), EdgeAt(edges, e, x0, y1), EdgeAt(edges, e, x1, y1) );
+}
+
+//
+// Which of four points are inside an edge, one bit per point. The points are xs, ys away from
+// where the edge came to base, at most MSR_EDGE_REACH pixels.
+//
+
+static inline int EdgeMask( const MSR_EdgeSetup &edges, Uint32 e, __m128i base, __m128i xs, __m128i ys )
+{
+	__m128i v = _mm_add_epi32( base, _mm_mullo_epi32(_mm_set1_epi32(edges.dx[e]), ys) );
+	v = _mm_sub_epi32( v, _mm_mullo_epi32(_mm_set1_epi32(edges.dy[e]), xs) );
+	return _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32(v, _mm_setzero_si128()) ) );
+}
+
+//
+// Coverage of the first rows rows of a small face's stamp, eight bits a row
+//
+
+static inline Uint64 CoverStamp( const MSR_TransformedFace *face, const MSR_EdgeSetup &edges, int rows )
+{
+	__m128i x0 = _mm_setr_epi32( 0 << 4, 1 << 4, 2 << 4, 3 << 4 );
+	__m128i x1 = _mm_add_epi32( x0, _mm_set1_epi32(4 << 4) );
+	__m128i base[3];
+	for( Uint32 e=0; e<3; e++ )
+		base[e] = _mm_set1_epi32( EdgeAt(edges, e, face->stamp_x << 4, face->stamp_y << 4) );
+
+	Uint64 mask = 0;
+	for( int r=0; r<rows; r++ )
+	{
+		__m128i ys = _mm_set1_epi32( r << 4 );
+		int left = 0xF, right = 0xF;
+		for( Uint32 e=0; e<3; e++ ) {
+			left &= EdgeMask( edges, e, base[e], x0, ys );
+			right &= EdgeMask( edges, e, base[e], x1, ys );
+		}
+		mask |= (Uint64)(left | (right << 4)) << (r * 8);
+	}
+	return mask;
+}
+
+//
+// Classify tiles [tx0, tx1] of row ty four at a time and bin the face in those it touches
+//
+
+static inline void BinTileRow( MSR_DrawState *state, const MSR_TransformedFace *face, Uint32 face_idx, const MSR_EdgeSetup &edges, int tx0, int tx1, int ty, Uint32 thread_id )
+{
+	const int size = 1 << TILE_FP_SHIFT;
+	__m128i zero = _mm_setzero_si128();
+	__m128i edge = _mm_set1_epi32( size - 1 );
+	int y = ty << TILE_FP_SHIFT;
+
+	for( int tx = tx0; tx <= tx1; tx += 4 )
+	{
+		int x = tx << TILE_FP_SHIFT;
+
+		// A tile touches the face if it has a corner inside each edge, and is covered if all of
+		// its corners are inside all of them
+		int hit = 0xF, accept = 0xF;
+		for( Uint32 e=0; e<3; e++ ) {
+			__m128i base = _mm_setr_epi32( EdgeAt(edges, e, x, y), EdgeAt(edges, e, x + size, y), EdgeAt(edges, e, x + 2 * size, y), EdgeAt(edges, e, x + 3 * size, y) );
+			int m00 = EdgeMask( edges, e, base, zero, zero );
+			int m10 = EdgeMask( edges, e, base, edge, zero );
+			int m01 = EdgeMask( edges, e, base, zero, edge );
+			int m11 = EdgeMask( edges, e, base, edge, edge );
+			hit &= m00 | m10 | m01 | m11;
+			accept &= m00 & m10 & m01 & m11;
+		}
+
+		int count = min( 4, tx1 - tx + 1 );
+		for( int i=0; i<count; i++ )
+			if( hit & (1 << i) )
+				BinFace( state, face, face_idx, ty * state->target->num_tiles_x + tx + i, (Uint8)((accept >> i) & 1), thread_id );
+	}
+}
+
+void InsertTransformedTriangle(MSR_DrawState *state, MSR_TransformedVertex *v0, MSR_TransformedVertex *v1, MSR_TransformedVertex *v2, Uint32 thread_id)
 {
 	// Perform Back-face culling
 	float d1x = v2->p.x - v0->p.x;
@@ -192,9 +494,9 @@ void InsertTransformedTriangle(MSR_TransformedVertex *v0, MSR_TransformedVertex
 	float d2y = v2->p.y - v1->p.y;
 
 	float value = d1x * d2y - d1y * d2x;
-	if( render_context.cull_mode == MSR_CULL_CCW && value > 0 )
+	if( state->context.cull_mode == MSR_CULL_CCW && value > 0 )
 		return;
-	else if( render_context.cull_mode == MSR_CULL_CW && value < 0 ) 
+	else if( state->context.cull_mode == MSR_CULL_CW && value < 0 ) 
 		return;
 		
 	if( value > 0 )
@@ -204,38 +506,72 @@ void InsertTransformedTriangle(MSR_TransformedVertex *v0, MSR_TransformedVertex
 		v2 = tmp;
 	}
 
-	Uint32 base_index = vertex_buffer_size[thread_id];
+	Uint32 base_index = state->vertex_buffer_size[thread_id];
 	Uint32 face_idx = base_index / 3;
-	MSR_TransformedFace *face = &face_buffer[thread_id][face_idx];
+	MSR_TransformedFace *face = &state->face_buffer[thread_id][face_idx];
 
 	// Cache perspective correct varyings for v0
 	face->v0x = v0->p.x; face->v0y = v0->p.y; face->v0w = v0->p.w;
-	for( Uint32 i=0; i<render_context.num_varyings; i++ )
+	for( Uint32 i=0; i<state->context.num_varyings; i++ )
 		face->v0v[i] = v0->p.w * v0->varyings[i];
 
 	// Compute fixed point coordinates
-	face->fp1[0] = iround(16.0f * v0->p.x);
-	face->fp2[0] = iround(16.0f * v1->p.x);
-	face->fp3[0] = iround(16.0f * v2->p.x);
-	face->fp1[1] = iround(16.0f * v0->p.y);
-	face->fp2[1] = iround(16.0f * v1->p.y);
-	face->fp3[1] = iround(16.0f * v2->p.y);
+	const int X1 = iround(16.0f * v0->p.x);
+	const int X2 = iround(16.0f * v1->p.x);
+	const int X3 = iround(16.0f * v2->p.x);
+	const int Y1 = iround(16.0f * v0->p.y);
+	const int Y2 = iround(16.0f * v1->p.y);
+	const int Y3 = iround(16.0f * v2->p.y);
 
 	// Deltas
-	const int DX12 = face->fp1[0] - face->fp2[0];
-	const int DX23 = face->fp2[0] - face->fp3[0];
-	const int DX31 = face->fp3[0] - face->fp1[0];
-	const int DY12 = face->fp1[1] - face->fp2[1];
-	const int DY23 = face->fp2[1] - face->fp3[1];
-	const int DY31 = face->fp3[1] - face->fp1[1];
-
-	// Fixed-point deltas
-	const int FDX12 = DX12 << 4;
-	const int FDX23 = DX23 << 4;
-	const int FDX31 = DX31 << 4;
-	const int FDY12 = DY12 << 4;
-	const int FDY23 = DY23 << 4;
-	const int FDY31 = DY31 << 4;
+	const int DX12 = X1 - X2;
+	const int DX23 = X2 - X3;
+	const int DX31 = X3 - X1;
+	const int DY12 = Y1 - Y2;
+	const int DY23 = Y2 - Y3;
+	const int DY31 = Y3 - Y1;
+
+	// Half-edge constants, and the deltas once more for the rasterizer
+	MSR_EdgeSetup &edges = face->edges;
+	edges.c[0] = (Sint64)DY12 * X1 - (Sint64)DX12 * Y1; edges.dx[0] = DX12; edges.dy[0] = DY12;
+	edges.c[1] = (Sint64)DY23 * X2 - (Sint64)DX23 * Y2; edges.dx[1] = DX23; edges.dy[1] = DY23;
+	edges.c[2] = (Sint64)DY31 * X3 - (Sint64)DX31 * Y3; edges.dx[2] = DX31; edges.dy[2] = DY31;
+
+	// Correct for fill convention
+	if(DY12 < 0 || (DY12 == 0 && DX12 > 0)) edges.c[0]++;
+	if(DY23 < 0 || (DY23 == 0 && DX23 > 0)) edges.c[1]++;
+	if(DY31 < 0 || (DY31 == 0 && DX31 > 0)) edges.c[2]++;
+
+	// Steps from the first pixel of a quad to the others
+	for( Uint32 e=0; e<3; e++ )
+		edges.offset[e] = _mm_mullo_epi32( _mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(edges.dy[e] << 4) );
+	
+	// Compute the fixed point bounding box
+	face->minx = min(X1, min(X2, X3));
+	face->maxx = max(X1, max(X2, X3));
+	face->miny = min(Y1, min(Y2, Y3));
+	face->maxy = max(Y1, max(Y2, Y3));
+
+	// Pixel centres inside the bounding box. Without any the face covers nothing.
+	int sx0 = (face->minx + 0xF) >> 4;
+	int sx1 = face->maxx >> 4;
+	int sy0 = (face->miny + 0xF) >> 4;
+	int sy1 = face->maxy >> 4;
+	if( sx0 > sx1 || sy0 > sy1 )
+		return;
+
+	// Faces that fit a stamp of 8x8 pixels, starting on a quad, have their coverage worked out
+	// here once. It saves them the block setup of the rasterizer, and those that miss every
+	// pixel centre never get binned.
+	face->stamp_mask = 0;
+	if( sx1 - (sx0 & ~3) < 8 && sy1 - sy0 < 8 )
+	{
+		face->stamp_x = sx0 & ~3;
+		face->stamp_y = sy0;
+		face->stamp_mask = CoverStamp( face, edges, sy1 - sy0 + 1 );
+		if( !face->stamp_mask )
+			return;
+	}
 
 	// Compute interpolation data
 	float FLTDX21, FLTDX31, FLTDY21, FLTDY31, INTERP_C;
@@ -251,7 +587,7 @@ void InsertTransformedTriangle(MSR_TransformedVertex *v0, MSR_TransformedVertex
 					 face->dw.x, face->dw.y);
 
 	// Setup the rest of the interpolates
-	for( Uint32 i=0; i<render_context.num_varyings; i++ ) 
+	for( Uint32 i=0; i<state->context.num_varyings; i++ ) 
 	{
 		float v0v = v0->varyings[i] * v0->p.w;
 		float v1v = v1->varyings[i] * v1->p.w;
@@ -261,285 +597,774 @@ void InsertTransformedTriangle(MSR_TransformedVertex *v0, MSR_TransformedVertex
 						 face->dv[i].x, face->dv[i].y);
 	}
 
-	// Half-edge constants
-	face->c1 = DY12 * face->fp1[0] - DX12 * face->fp1[1];
-	face->c2 = DY23 * face->fp2[0] - DX23 * face->fp2[1];
-	face->c3 = DY31 * face->fp3[0] - DX31 * face->fp3[1];
+	// The nearest point of the face is at a vertex. The margin covers snapping the vertices to
+	// 28.4 and the rounding of the interpolation, which may start up to a tile away.
+	float dwx = fabsf(face->dw.x);
+	float dwy = fabsf(face->dw.y);
+	float near_w = max(v0->p.w, max(v1->p.w, v2->p.w));
+	float extent = dwx * ((face->maxx - face->minx) / 16.0f + MSR_SCREEN_TILE_SIZE) + dwy * ((face->maxy - face->miny) / 16.0f + MSR_SCREEN_TILE_SIZE);
+	face->near_w = near_w + dwx + dwy + (fabsf(near_w) + extent) * (1.0f / 65536.0f);
 
-	// Correct for fill convention
-	if(DY12 < 0 || (DY12 == 0 && DX12 > 0)) face->c1++;
-	if(DY23 < 0 || (DY23 == 0 && DX23 > 0)) face->c2++;
-	if(DY31 < 0 || (DY31 == 0 && DX31 > 0)) face->c3++;
-	
-	// Compute the fixed point bounding box
-	face->minx = min(face->fp1[0], min(face->fp2[0], face->fp3[0]));
-	face->maxx = max(face->fp1[0], max(face->fp2[0], face->fp3[0]));
-	face->miny = min(face->fp1[1], min(face->fp2[1], face->fp3[1]));
-	face->maxy = max(face->fp1[1], max(face->fp2[1], face->fp3[1]));
-
-	// Loop through each tile and test the triangle against it.
+	// Tiles the bounding box touches
 	int min_index_x = max( (face->minx >> 4) >> MSR_SCREEN_TILE_SIZE_SHIFT, 0);
-	int max_index_x = min( (face->maxx >> 4) >> MSR_SCREEN_TILE_SIZE_SHIFT, (int)set_render_target->num_tiles_x-1);
+	int max_index_x = min( (face->maxx >> 4) >> MSR_SCREEN_TILE_SIZE_SHIFT, (int)state->target->num_tiles_x-1);
 	int min_index_y = max( (face->miny >> 4) >> MSR_SCREEN_TILE_SIZE_SHIFT, 0);
-	int max_index_y = min( (face->maxy >> 4) >> MSR_SCREEN_TILE_SIZE_SHIFT, (int)set_render_target->num_tiles_y-1);
+	int max_index_y = min( (face->maxy >> 4) >> MSR_SCREEN_TILE_SIZE_SHIFT, (int)state->target->num_tiles_y-1);
 
-	for( int y = min_index_y; y <= max_index_y; y++ ) 
-	{	
-		for( int x = min_index_x; x <= max_index_x; x++ ) 
+	// Thin triangles go into every tile they might touch, testing them is not worth it
+	if( max_index_x - min_index_x <= 2 || max_index_y - min_index_y <= 2 )
+	{
+		for( int y = min_index_y; y <= max_index_y; y++ ) 
+			for( int x = min_index_x; x <= max_index_x; x++ ) 
+				BinFace( state, face, face_idx, y * state->target->num_tiles_x + x, 0, thread_id );
+	}
+	else
+	{
+		// Test the super-tiles first, each clipped to the bounding box. A rectangle that is
+		// outside an edge at all four corners is outside it everywhere, one that is inside all
+		// of them at every corner is covered, and either holds for every tile in it.
+		for( int sy = min_index_y >> MSR_SUPER_TILE_SHIFT; sy <= max_index_y >> MSR_SUPER_TILE_SHIFT; sy++ ) 
 		{
-			if( max_index_x - min_index_x <= 2 || max_index_y - min_index_y <= 2 )
-			{
-				Uint32 tile_idx = y * set_render_target->num_tiles_x + x;
-				MSR_Tile &tile = set_render_target->tiles[tile_idx];
-				tile.index_buffer[ thread_id ][ tile.index_buffer_size[ thread_id ] ] = face_idx;
-				tile.index_buffer_size[ thread_id ]++;
-				tile.frag_tiles[ thread_id ][ face_idx ] = 0;
-
-				if( InterlockedIncrement((Uint32*)&tile.dirty) == 1 ) {
-					Uint32 job_idx = InterlockedIncrement((Uint32*)&job_queue_end) - 1;
-					set_render_target->job_queue[job_idx] = tile_idx; 
-				}
-			}
-			else
-			{
-				// Corners of tile
-				int x0 = x << (MSR_SCREEN_TILE_SIZE_SHIFT + 4);
-				int x1 = ( (x + 1) << (MSR_SCREEN_TILE_SIZE_SHIFT + 4) ) - 1;
-				int y0 = y << (MSR_SCREEN_TILE_SIZE_SHIFT + 4);
-				int y1 = ( (y + 1) << (MSR_SCREEN_TILE_SIZE_SHIFT + 4) ) - 1;
-
-				// Evaluate half-space functions
-				bool a00 = face->c1 + DX12 * y0 - DY12 * x0 > 0;
-				bool a10 = face->c1 + DX12 * y0 - DY12 * x1 > 0;
-				bool a01 = face->c1 + DX12 * y1 - DY12 * x0 > 0;
-				bool a11 = face->c1 + DX12 * y1 - DY12 * x1 > 0;
-				int a = (a00 << 0) | (a10 << 1) | (a01 << 2) | (a11 << 3);
-
-				bool b00 = face->c2 + DX23 * y0 - DY23 * x0 > 0;
-				bool b10 = face->c2 + DX23 * y0 - DY23 * x1 > 0;
-				bool b01 = face->c2 + DX23 * y1 - DY23 * x0 > 0;
-				bool b11 = face->c2 + DX23 * y1 - DY23 * x1 > 0;
-				int b = (b00 << 0) | (b10 << 1) | (b01 << 2) | (b11 << 3);
-
-				bool c00 = face->c3 + DX31 * y0 - DY31 * x0 > 0;
-				bool c10 = face->c3 + DX31 * y0 - DY31 * x1 > 0;
-				bool c01 = face->c3 + DX31 * y1 - DY31 * x0 > 0;
-				bool c11 = face->c3 + DX31 * y1 - DY31 * x1 > 0;
-				int c = (c00 << 0) | (c10 << 1) | (c01 << 2) | (c11 << 3);
+			int ty0 = max( sy << MSR_SUPER_TILE_SHIFT, min_index_y );
+			int ty1 = min( ((sy + 1) << MSR_SUPER_TILE_SHIFT) - 1, max_index_y );
 
-				// Skip block when outside an edge
-				if(a == 0x0 || b == 0x0 || c == 0x0) continue;
+			for( int sx = min_index_x >> MSR_SUPER_TILE_SHIFT; sx <= max_index_x >> MSR_SUPER_TILE_SHIFT; sx++ ) 
+			{
+				int tx0 = max( sx << MSR_SUPER_TILE_SHIFT, min_index_x );
+				int tx1 = min( ((sx + 1) << MSR_SUPER_TILE_SHIFT) - 1, max_index_x );
 
-				Uint32 tile_idx = y * set_render_target->num_tiles_x + x;
-				MSR_Tile &tile = set_render_target->tiles[tile_idx];
-				tile.index_buffer[ thread_id ][ tile.index_buffer_size[ thread_id ] ] = face_idx;
-				tile.index_buffer_size[ thread_id ]++;
+				int x0 = tx0 << TILE_FP_SHIFT, x1 = ((tx1 + 1) << TILE_FP_SHIFT) - 1;
+				int y0 = ty0 << TILE_FP_SHIFT, y1 = ((ty1 + 1) << TILE_FP_SHIFT) - 1;
+				__m128i zero = _mm_setzero_si128();
+				int a = EdgeMask( edges, 0, EdgeCorners(edges, 0, x0, y0, x1, y1), zero, zero );
+				int b = EdgeMask( edges, 1, EdgeCorners(edges, 1, x0, y0, x1, y1), zero, zero );
+				int c = EdgeMask( edges, 2, EdgeCorners(edges, 2, x0, y0, x1, y1), zero, zero );
 
-				if( InterlockedIncrement((Uint32*)&tile.dirty) == 1 ) {
-					Uint32 job_idx = InterlockedIncrement((Uint32*)&job_queue_end) - 1;
-					set_render_target->job_queue[job_idx] = tile_idx; 
+				// Skip block when outside an edge
+				if( a == 0x0 || b == 0x0 || c == 0x0 ) continue;
+
+				// Every tile in a covered super-tile is trivially accepted
+				if( a == 0xF && b == 0xF && c == 0xF ) {
+					for( int y = ty0; y <= ty1; y++ )
+						for( int x = tx0; x <= tx1; x++ )
+							BinFace( state, face, face_idx, y * state->target->num_tiles_x + x, 1, thread_id );
+					continue;
 				}
 
-				// Test if we can trivially accept the entire tile
-				tile.frag_tiles[ thread_id ][ face_idx ] = ( a != 0xF || b != 0xF || c != 0xF ) ? 0 : 1;
+				for( int y = ty0; y <= ty1; y++ )
+					BinTileRow( state, face, face_idx, edges, tx0, tx1, y, thread_id );
 			}
 		}
 	}	
 
 	// Add the vertices to the vertex buffer
-	CopyVertex(&vertex_buffer[thread_id][base_index], v0);
-	CopyVertex(&vertex_buffer[thread_id][base_index+1], v1);
-	CopyVertex(&vertex_buffer[thread_id][base_index+2], v2);
+	CopyVertex(&state->vertex_buffer[thread_id][base_index], v0);
+	CopyVertex(&state->vertex_buffer[thread_id][base_index+1], v1);
+	CopyVertex(&state->vertex_buffer[thread_id][base_index+2], v2);
 
 	// Set the vertex pointers
-	face->v[0] = &vertex_buffer[thread_id][base_index]; 
-	face->v[1] = &vertex_buffer[thread_id][base_index+1]; 
-	face->v[2] = &vertex_buffer[thread_id][base_index+2];
+	face->v[0] = &state->vertex_buffer[thread_id][base_index]; 
+	face->v[1] = &state->vertex_buffer[thread_id][base_index+1]; 
+	face->v[2] = &state->vertex_buffer[thread_id][base_index+2];
+
+	state->vertex_buffer_size[thread_id] += 3;
+}
+
+void ProcessTrianglesV( MSR_ThreadRenderData *trd, Uint32 thread_id ) 
+{
+	MSR_DrawState *state = &trd->draw;
+	MSR_Vertex *vertices = trd->vertices;
+	Uint32 *indices = trd->indices;
+
+	// The cache is only good within a draw call. Each thread clears its own, as the others may
+	// still be in the middle of the previous batch.
+	if( vertex_cache_draw[thread_id] != trd->draw_id ) {
+		for( Uint32 j=0; j<MSR_VERTEX_CACHE_SIZE; j++ ) vertex_cache[thread_id][j].tag = UINT_MAX;
+		vertex_cache_draw[thread_id] = trd->draw_id;
+	}
+
+	// A deferred frame keeps appending to the buffers until it is drawn
+	if( !trd->chunk_base )
+		state->vertex_buffer_size[thread_id] = 0;
+
+	// Only take another chunk while there is room for it to clip up to the same ratio the
+	// vertex buffers are sized for
+	Uint32 chunk_indices = trd->chunk_size * 3;
+	Uint32 chunk_reserve = chunk_indices * (MSR_VERTEX_BUFFER_SIZE_CLIP / MSR_VERTEX_BUFFER_SIZE);
+	Uint32 max_vertices = MSR_VERTEX_BUFFER_SIZE_CLIP / num_work_threads;
+
+	while( state->vertex_buffer_size[thread_id] + chunk_reserve <= max_vertices )
+	{
+		Uint32 chunk = trd->next_chunk.fetch_add(1, std::memory_order_relaxed);
+		if( chunk >= trd->num_chunks )
+			break;
+
+		Uint32 first = (chunk - trd->chunk_base) * chunk_indices;
+		Uint32 end = min( first + chunk_indices, trd->num_indices );
+		for( Uint32 i = first; i < end; i+=3 ) 
+		{
+			// The maximum amount of vertices after clipping
+			MSR_TransformedVertex v[CLIP_BUFFER_SIZE];
+			GetTransformedVertex(state,thread_id,vertices,indices[i  ],&v[0]);
+			GetTransformedVertex(state,thread_id,vertices,indices[i+1],&v[1]);
+			GetTransformedVertex(state,thread_id,vertices,indices[i+2],&v[2]);
+
+			// Clip and insert triangle, and any additional triangles generated by clipping.
+			ClipTriangle(state, v, thread_id);
+		}
+
+		// Our faces for this chunk are all binned
+		trd->chunk_owner[chunk] = thread_id;
+		trd->chunk_face_end[chunk] = state->vertex_buffer_size[thread_id] / 3;
+		trd->chunk_done[chunk].store(1, std::memory_order_release);
+	}
+}
+
+//
+// Find how many chunks from the start of the batch are completely binned
+//
+
+static Uint32 GetReadyChunks( MSR_ThreadRenderData *trd )
+{
+	Uint32 ready = 0;
+	while( ready < trd->num_chunks && trd->chunk_done[ready].load(std::memory_order_acquire) )
+		ready++;
+	return ready;
+}
+
+static bool CompareTileJobs( const MSR_TileJob &a, const MSR_TileJob &b )
+{
+	return a.cost > b.cost;
+}
 
-	vertex_buffer_size[thread_id] += 3;
+static inline void AddTileJob( MSR_TileBins *bins, Uint32 tile_idx, Uint32 cost, Uint32 x, Uint32 y, Uint32 width, Uint32 height, MSR_FragmentBuffer *frag_buffer )
+{
+	MSR_TileJob &job = bins->jobs[ bins->num_jobs++ ];
+	job.tile_idx = tile_idx;
+	job.cost = cost;
+	job.x = (Uint16)x;
+	job.y = (Uint16)y;
+	job.width = (Uint16)width;
+	job.height = (Uint16)height;
+	job.frag_buffer = frag_buffer;
+
+	// Split buffers go to a different tile every batch
+	frag_buffer->x = bins->tiles[tile_idx].x;
+	frag_buffer->y = bins->tiles[tile_idx].y;
+}
+
+//
+// Turn the binned tiles into jobs, heaviest first. Binning pushes tiles in first touch order, which
+// tends to leave the busiest tile (e.g. the middle of a model) for last while everybody else idles.
+// Tiles that would still hold up the batch on their own are split into sub-tile jobs. Every job
+// walks the bins in submission order and jobs never overlap, so the image is the same.
+//
+
+void BuildTileJobs( MSR_ThreadRenderData *trd )
+{
+	MSR_TileBins *bins = trd->draw.bins;
+	MSR_Tile *tiles = bins->tiles;
+	Uint32 *job_queue = bins->job_queue;
+	Uint32 num_tiles = bins->job_queue_end.load(std::memory_order_relaxed);
+
+	trd->split_tiles = 0;
+
+	// Only count what was not rasterized early, assuming the faces left cost about the average
+	Uint32 total_cost = 0;
+	for( Uint32 i=0; i<num_tiles; i++ )
+	{
+		MSR_Tile &tile = tiles[ job_queue[i] ];
+		Uint32 faces = 0, faces_left = 0;
+		tile.job_cost = 0;
+		for( Uint32 t=0; t<num_work_threads; t++ ) {
+			MSR_TileBin &bin = bins->thread_bins[t][ job_queue[i] ];
+			Uint32 bin_size = bin.size.load(std::memory_order_relaxed);
+			tile.job_cost += bin.cost;
+			faces += bin_size;
+			faces_left += bin_size - tile.raster_cursor[t].pos;
+		}
+		if( faces_left != faces )
+			tile.job_cost = (Uint32)( (Uint64)tile.job_cost * faces_left / faces );
+		total_cost += tile.job_cost;
+	}
+
+	Uint32 split_cost = max( (Uint32)MSR_TILE_SPLIT_MIN_COST, total_cost / (num_work_threads * MSR_TILE_SPLIT_SHARE) );
+	Uint32 free_buffers = MSR_TILE_SPLIT_BUFFERS;
+
+	bins->num_jobs = 0;
+	for( Uint32 i=0; i<num_tiles; i++ )
+	{
+		Uint32 tile_idx = job_queue[i];
+		MSR_Tile &tile = tiles[tile_idx];
+
+		// Pick the sub-tile size, going coarser if we are running out of buffers. A tile that
+		// already has fragments from the early raster has to stay whole, and with a single
+		// thread there is nobody to share the pieces with.
+		Uint32 size = MSR_SCREEN_TILE_SIZE;
+		if( split_hot_tiles && num_work_threads > 1 && tile.job_cost > split_cost && !tile.raster_progress.load(std::memory_order_relaxed) ) {
+			size = ( tile.job_cost > 4 * split_cost ) ? MSR_SCREEN_TILE_SIZE/4 : MSR_SCREEN_TILE_SIZE/2;
+			while( size < MSR_SCREEN_TILE_SIZE && (MSR_SCREEN_TILE_SIZE/size) * (MSR_SCREEN_TILE_SIZE/size) > free_buffers )
+				size <<= 1;
+		}
+
+		if( size == MSR_SCREEN_TILE_SIZE ) {
+			AddTileJob( bins, tile_idx, tile.job_cost, tile.x, tile.y, tile.width, tile.height, &tile.frag_buffer );
+			tile.dirty.store(1, std::memory_order_relaxed);
+			tile.shade_pending.store(1, std::memory_order_relaxed);
+			continue;
+		}
+
+		Uint32 sub_cost = tile.job_cost / ( (MSR_SCREEN_TILE_SIZE/size) * (MSR_SCREEN_TILE_SIZE/size) );
+		Uint32 sub_jobs = 0;
+		for( Uint32 sy=0; sy<=tile.height; sy+=size ) {
+			for( Uint32 sx=0; sx<=tile.width; sx+=size ) {
+				MSR_FragmentBuffer *fb = &bins->split_buffers[ MSR_TILE_SPLIT_BUFFERS - free_buffers-- ];
+				AddTileJob( bins, tile_idx, sub_cost, tile.x + sx, tile.y + sy, min(size-1, tile.width-sx), min(size-1, tile.height-sy), fb );
+				sub_jobs++;
+			}
+		}
+
+		// The last job out of this tile resets its bins
+		tile.dirty.store(sub_jobs, std::memory_order_relaxed);
+		tile.shade_pending.store(sub_jobs, std::memory_order_relaxed);
+		trd->split_tiles++;
+	}
+
+	if( sort_tile_jobs )
+		std::sort( bins->jobs, bins->jobs + bins->num_jobs, CompareTileJobs );
+
+	for( Uint32 i=0; i<bins->num_jobs; i++ )
+		bins->job_ready[i].store(1, std::memory_order_relaxed);
+}
+
+//
+// A tile's pixels have to be shaded in submission order. If the batch before this one drew to
+// the same target, a worker waits until it is through with the tile. Its jobs were built before
+// any of ours, and no worker gets to the batch after ours before it is done with ours, so once
+// the count is down to zero it stays there. The submitting thread only shades a batch after it
+// has retired the one before, by which time that slot may hold the next batch, so it must not look.
+//
+
+static inline bool PreviousShadingDone( MSR_DrawState *state, Uint32 tile_idx )
+{
+	return !state->prev_bins || !state->prev_bins->tiles[tile_idx].shade_pending.load(std::memory_order_acquire);
+}
+
+static inline void WaitForPreviousShading( MSR_DrawState *state, Uint32 tile_idx, Uint32 thread_id )
+{
+	if( thread_id && state->prev_bins )
+		MSR_SyncWaitUntil(&state->prev_bins->tiles[tile_idx].shade_pending, 0);
+}
+
+//
+// Bring a tile's hierarchical Z up to date with its blocks, once it is shaded. The next batch
+// may already be shading it, which can only make the blocks farther.
+//
+
+static void UpdateTileHiZ( MSR_DrawState *state, Uint32 tile_idx )
+{
+	MSR_RenderTarget *target = state->target;
+	if( !target->hiz_tiles ) return;
+
+	MSR_Tile &tile = state->bins->tiles[tile_idx];
+	const MSR_AtomicU32 *row = target->hiz_blocks + (tile.y >> MSR_HIZ_BLOCK_SHIFT) * target->hiz_pitch + (tile.x >> MSR_HIZ_BLOCK_SHIFT);
+
+	float depth = FLT_MAX;
+	for( Uint32 by=0; by<=(Uint32)(tile.height >> MSR_HIZ_BLOCK_SHIFT); by++, row += target->hiz_pitch ) {
+		for( Uint32 bx=0; bx<=(Uint32)(tile.width >> MSR_HIZ_BLOCK_SHIFT); bx++ ) {
+			float block_depth = MSR_HiZLoad(row[bx]);
+			if( block_depth < depth ) depth = block_depth;
+		}
+	}
+
+	MSR_HiZStore(target->hiz_tiles[tile_idx], depth);
+}
+
+static inline void FinishShading( MSR_DrawState *state, Uint32 tile_idx )
+{
+	MSR_Tile &tile = state->bins->tiles[tile_idx];
+	if( tile.shade_pending.fetch_sub(1, std::memory_order_acq_rel) == 1 ) {
+		UpdateTileHiZ(state, tile_idx);
+		MSR_SyncWake(&tile.shade_pending);
+	}
+}
+
+//
+// Shade what a job has piled up so far, so the rasterizer can go on with an empty buffer. The
+// tile is ours as soon as the last batch is through with it, and the rest of the job's
+// fragments come after these, so it all still goes out in submission order.
+//
+
+static void FlushFragments( MSR_ThreadRenderData *trd, MSR_DrawState *state, const MSR_TileJob &job, Uint32 worker_id )
+{
+	WaitForPreviousShading(&trd->draw, job.tile_idx, worker_id);
+	PrepareTileJob(trd->draw.target, job);
+	state->RenderFragments(state, job.frag_buffer);
+}
+
+//
+// Rasterize the faces from vertex chunks [first_chunk, end_chunk) binned in a tile, for the
+// region covered by job. Every thread's bin is in chunk order, so going chunk by chunk and
+// taking the faces from whoever owned it gives back submission order. cursor holds the
+// position in each bin and is left after the last face consumed. In a deferred frame the
+// chunks come from different draws, and whatever is queued is shaded before the state changes.
+//
+
+static void RasterizeBins( MSR_ThreadRenderData *trd, MSR_Tile &tile, const MSR_TileJob &job, Uint32 first_chunk, Uint32 end_chunk, MSR_BinCursor *cursor, Uint32 worker_id )
+{
+	MSR_DrawState *state = &trd->draw;
+	bool whole_tile = ( job.frag_buffer == &tile.frag_buffer );
+
+	// Convert to fixed point to save the rasterizer from having to do it
+	Uint32 tile_x = job.x << 4;
+	Uint32 tile_y = job.y << 4;
+	Uint32 tile_width = job.width << 4;
+	Uint32 tile_height = job.height << 4;
+
+	for( Uint32 chunk=first_chunk; chunk<end_chunk; chunk++ )
+	{
+		if( trd->draws && state != &trd->draws[ trd->chunk_draw[chunk] ] ) {
+			if( job.frag_buffer->elements )
+				state->RenderFragments(state, job.frag_buffer);
+			state = &trd->draws[ trd->chunk_draw[chunk] ];
+		}
+
+		Uint32 thread_id = trd->chunk_owner[chunk];
+		Uint32 face_end = trd->chunk_face_end[chunk];
+		MSR_TileBin &bin = trd->draw.bins->thread_bins[thread_id][job.tile_idx];
+		Uint32 bin_size = bin.size.load(std::memory_order_acquire);
+		MSR_BinCursor &bc = cursor[thread_id];
+
+		for( ; bc.pos<bin_size; bc.pos++ )
+		{
+			Uint32 offset = bc.pos & (MSR_BIN_CHUNK_SIZE - 1);
+			MSR_BinChunk *bin_chunk = offset ? bc.chunk : ( bc.chunk ? bc.chunk->next : bin.head );
+			Uint32 entry = bin_chunk->faces[offset];
+			Uint32 idx = entry & ~MSR_BIN_ACCEPT;
+			if( idx >= face_end )
+				break;
+			bc.chunk = bin_chunk;
+
+			// First test to make sure that this hasn't been trivially accepted. If it has, we're done!
+			if( !(entry & MSR_BIN_ACCEPT) ) {
+
+				// A piece of a split tile only sees some of the tile's faces
+				const MSR_TransformedFace *face = &state->face_buffer[thread_id][idx];
+				if( !whole_tile ) {
+					if( face->maxx < (int)tile_x || face->minx > (int)(tile_x + tile_width) || 
+						face->maxy < (int)tile_y || face->miny > (int)(tile_y + tile_height) )
+						continue;
+				}
+
+				// Small faces come with their coverage
+				if( face->stamp_mask )
+					state->RasterizeStamp(state, thread_id, idx, job.frag_buffer,tile_x,tile_y,tile_width,tile_height);
+				else
+					state->RasterizeTriangle(state, thread_id, idx, job.frag_buffer,tile_x,tile_y,tile_width,tile_height);
+			}
+			else if( whole_tile )
+			{
+				MSR_FragmentBufferAdd(job.frag_buffer, MSR_FRAGMENT_STATE_TILE, thread_id, idx, tile.x, tile.y, 0);
+			}
+			else
+			{
+				// Only part of the tile is ours, so cover it in whole blocks instead
+				for( Uint32 by=job.y; by<=(Uint32)job.y+job.height; by+=8 ) {
+					for( Uint32 bx=job.x; bx<=(Uint32)job.x+job.width; bx+=8 ) {
+						MSR_FragmentBufferAddBlock(job.frag_buffer, thread_id, idx, bx, by);
+					}
+				}
+			}
+
+			// No matter how deep the overdraw, the buffer has to have room for the next face
+			if( MSR_FragmentBufferFull(job.frag_buffer) )
+				FlushFragments(trd, state, job, worker_id);
+
+			// Shade while the fragments are still in cache. Fragments go out in the same order
+			// either way, and rasterization never looks at the frame buffer.
+			if( fused_tiles && job.frag_buffer->elements >= MSR_FRAGMENT_FUSED_FLUSH )
+				state->RenderFragments(state, job.frag_buffer);
+		}
+	}
+
+	if( fused_tiles )
+		state->RenderFragments(state, job.frag_buffer);
 }
 
-void ProcessTrianglesV( Uint32 thread_id ) 
+//
+// Rasterize what is already binned while other threads are still in the vertex stage. Once
+// chunks 0..c are done, a tile's faces from them are final, so working through that prefix in
+// order gives the same fragment stream as waiting for everybody. Returns false if there was
+// nothing to do.
+//
+
+bool ProcessTrianglesEarly( MSR_ThreadRenderData *trd, Uint32 thread_id )
 {
-	MSR_Vertex *vertices = thread_render_data->vertices;
-	Uint32 *indices = thread_render_data->indices;
+	if( trd->draw.context.fill_mode != MSR_FILL_SOLID )
+		return false;
+
+	MSR_TileBins *bins = trd->draw.bins;
+	Uint32 ready = GetReadyChunks( trd );
 
-	for( Uint32 i = thread_render_data->partitions[thread_id].start_index; i < thread_render_data->partitions[thread_id].end_index; i+=3 ) 
+	bool worked = false;
+	for( Uint32 tile_idx=0; tile_idx<trd->draw.target->num_tiles; tile_idx++ )
 	{
-		// The maximum amount of vertices after clipping
-		MSR_TransformedVertex v[CLIP_BUFFER_SIZE];
-		GetTransformedVertex(thread_id,vertices,indices[i  ],&v[0]);
-		GetTransformedVertex(thread_id,vertices,indices[i+1],&v[1]);
-		GetTransformedVertex(thread_id,vertices,indices[i+2],&v[2]);
+		// Stop as soon as the last thread is through, it needs us off the tiles to build the jobs
+		if( trd->vertex_progress.load(std::memory_order_relaxed) >= num_work_threads )
+			break;
+
+		MSR_Tile &tile = bins->tiles[tile_idx];
+		if( !tile.dirty.load(std::memory_order_relaxed) || tile.raster_progress.load(std::memory_order_relaxed) >= ready )
+			continue;
+
+		// Fused tiles shade as they go, which has to wait for the last batch. Leave those for later.
+		if( fused_tiles && !PreviousShadingDone(&trd->draw, tile_idx) )
+			continue;
 
-		// Clip and insert triangle, and any additional triangles generated by clipping.
-		ClipTriangle(v, thread_id);
+		if( tile.raster_lock.exchange(1, std::memory_order_acquire) )
+			continue;
+
+		Uint32 first_chunk = tile.raster_progress.load(std::memory_order_relaxed);
+		if( first_chunk < ready )
+		{
+			MSR_TileJob job;
+			job.tile_idx = tile_idx;
+			job.x = tile.x;
+			job.y = tile.y;
+			job.width = tile.width;
+			job.height = tile.height;
+			job.frag_buffer = &tile.frag_buffer;
+
+			if( !first_chunk )
+				MSR_FragmentBufferClear(&tile.frag_buffer);
+			if( fused_tiles )
+				PrepareTileJob(trd->draw.target, job);
+
+			RasterizeBins(trd, tile, job, first_chunk, ready, tile.raster_cursor, thread_id);
+			tile.raster_progress.store(ready, std::memory_order_relaxed);
+			worked = true;
+		}
+
+		tile.raster_lock.store(0, std::memory_order_release);
 	}
+
+	return worked;
 }
 
-void ProcessTrianglesR( Uint32 thread_id ) 
+void ProcessTrianglesR( MSR_ThreadRenderData *trd, Uint32 thread_id ) 
 {
+	MSR_TileBins *bins = trd->draw.bins;
+
 	while(true) 
 	{
 		// Get the next item in the queue
-		Uint32 start = InterlockedIncrement(&job_queue_start_rt) - 1;
-		if( start >= job_queue_end ) {
+		Uint32 start = bins->job_queue_start_rt.fetch_add(1, std::memory_order_relaxed);
+		if( start >= bins->num_jobs ) {
 			break;
 		}
 
-		// Find our tile index
-		Uint32 tile_idx = set_render_target->job_queue[start];
-		MSR_Tile *tiles = set_render_target->tiles;
-		
-		// Convert to fixed point to save the rasterizer from having to do it
-		Uint32 tile_x, tile_y, tile_width, tile_height;
+		// Find our job and its tile
+		MSR_TileJob &job = bins->jobs[start];
+		MSR_Tile &tile = bins->tiles[job.tile_idx];
+		bool whole_tile = ( job.frag_buffer == &tile.frag_buffer );
 
-		if( render_context.fill_mode == MSR_FILL_SOLID ) 
+		if( fused_tiles ) {
+			WaitForPreviousShading(&trd->draw, job.tile_idx, thread_id);
+			PrepareTileJob(trd->draw.target, job);
+		}
+		
+		if( trd->draw.context.fill_mode == MSR_FILL_SOLID ) 
 		{
-			tile_x = tiles[tile_idx].x << 4;
-			tile_y = tiles[tile_idx].y << 4;
-			tile_width = tiles[tile_idx].width << 4;
-			tile_height = tiles[tile_idx].height << 4;
+			// Carry on from whatever was rasterized while the vertex stage was running. Pieces
+			// of a split tile each walk the bins from the start.
+			Uint32 first_chunk = 0;
+			MSR_BinCursor *cursor = raster_cursors[thread_id];
+			if( whole_tile ) {
+				first_chunk = tile.raster_progress.load(std::memory_order_relaxed);
+				cursor = tile.raster_cursor;
+			} else {
+				ZeroMemory(cursor, sizeof(MSR_BinCursor) * num_work_threads);
+			}
 
-			// Reset the number of fragments to zero
-			MSR_FragmentBufferClear(&tiles[tile_idx].frag_buffer);
+			if( !first_chunk )
+				MSR_FragmentBufferClear(job.frag_buffer);
 
-			for( Uint32 thread_id=0; thread_id<num_work_threads; thread_id++ )
-			{
-				for( Uint32 j=0; j<tiles[tile_idx].index_buffer_size[thread_id]; j++ )
-				{
-					Uint32 idx = tiles[tile_idx].index_buffer[thread_id][j];
-
-					// First test to make sure that this hasn't been trivially accepted. If it has, we're done!
-					if( !tiles[tile_idx].frag_tiles[ thread_id ][ idx ] )
-						RasterizeTriangleSolid(thread_id, idx, &tiles[tile_idx].frag_buffer,tile_x,tile_y,tile_width,tile_height);
-					else
-					{
-						MSR_Fragment *frag = MSR_FragmentBufferGetNext(&tiles[tile_idx].frag_buffer);
-						frag->state = MSR_FRAGMENT_STATE_TILE;
-						frag->thread_id = thread_id;
-						frag->face_idx = idx;
-						frag->x = tiles[tile_idx].x;
-						frag->y = tiles[tile_idx].y;
-					}
+			RasterizeBins(trd, tile, job, first_chunk, trd->num_chunks, cursor, thread_id);
 
-					// Now do a size check on the fragment buffer and resize if necessary
-					MSR_FragmentBufferResize(&tiles[tile_idx].frag_buffer);
-				}
+			// Every draw is in, so the faces left in the visibility buffer are the ones seen
+			if( visibility_buffer )
+				ResolveVisibility(trd->draws, job);
+		}
 
-				tiles[tile_idx].index_buffer_size[thread_id] = 0;
+		if( fused_tiles )
+			FinishShading(&trd->draw, job.tile_idx);
+
+		// Once every job on this tile is through with the bins, empty them for the next batch
+		if( tile.dirty.fetch_sub(1, std::memory_order_acq_rel) == 1 ) {
+			for( Uint32 t=0; t<num_work_threads; t++ ) {
+				MSR_TileBin &bin = bins->thread_bins[t][job.tile_idx];
+				bin.size.store(0, std::memory_order_relaxed);
+				bin.cost = 0;
+				tile.raster_cursor[t].chunk = NULL;
+				tile.raster_cursor[t].pos = 0;
 			}
+			tile.raster_progress.store(0, std::memory_order_relaxed);
 		}
 
-		tiles[tile_idx].dirty = 0;
+		// Hand the job over to whoever is waiting to shade it
+		MSR_SyncStore(&bins->job_ready[start], 0);
 	}
 }
 
-void ProcessFragments( Uint32 thread_id )
+void ProcessFragments( MSR_ThreadRenderData *trd, Uint32 thread_id )
 {
+	// Everything has been shaded during rasterization already
+	if( fused_tiles )
+		return;
+
+	MSR_DrawState *state = &trd->draw;
+	MSR_TileBins *bins = state->bins;
+
 	while(true)
 	{
 		// Get the next item in the queue
-		Uint32 start = InterlockedIncrement(&job_queue_start_ft) - 1;
-		if( start >= job_queue_end ) {
+		Uint32 start = bins->job_queue_start_ft.fetch_add(1, std::memory_order_relaxed);
+		if( start >= bins->num_jobs ) {
 			break;
 		}
 
-		Uint32 tile_idx = set_render_target->job_queue[start];
+		// Block if this is still being rasterized, or the last batch is still shading the tile
+		MSR_TileJob &job = bins->jobs[start];
+		MSR_SyncWaitUntil(&bins->job_ready[start], 0);
+		WaitForPreviousShading(state, job.tile_idx, thread_id);
 
-		// Block if this is still being rasterized
-		while( set_render_target->tiles[tile_idx].dirty ) Sleep(0);
-
-		RenderFragments(&set_render_target->tiles[tile_idx].frag_buffer);
+		PrepareTileJob(state->target, job);
+		state->RenderFragments(state, job.frag_buffer);
+		FinishShading(state, job.tile_idx);
 	}
 }
 
+//
+// Take a snapshot of the render state, drawing to the current target with the bins and
+// buffers of a batch slot
+//
+
+static void SnapshotDrawState( MSR_DrawState *draw, Uint32 slot )
+{
+	draw->context = render_context;
+	draw->target = set_render_target;
+	draw->bins = &set_render_target->bins[slot];
+	draw->vertex_buffer = vertex_buffer[slot];
+	draw->vertex_buffer_size = vertex_buffer_size[slot];
+	draw->face_buffer = face_buffer[slot];
+	draw->bin_arenas = bin_arenas[slot];
+	draw->draw_idx = 0;
+
+	// The tiled buffers this batch writes have to be resolved again
+	if( render_context.color_enabled ) set_render_target->color_dirty = true;
+	if( render_context.depth_enabled ) set_render_target->depth_dirty = true;
+
+	// Screen coordinates run from -guard to size - 1 + guard within the guard band
+	float guard = (float)min( render_context.guard_band, set_render_target->guard_band_max );
+	draw->guard_x = 1.0f + guard / ( 0.5f * set_render_target->back_buffer->clip_rect.w - 0.5f );
+	draw->guard_y = 1.0f + guard / ( 0.5f * set_render_target->back_buffer->clip_rect.h - 0.5f );
+
+	PrepareRasterizer(draw);
+}
+
+//
+// Get the bins of a draw ready to take a new batch. Only their job queue and the arenas are
+// left over, the tiles empty themselves once they are done.
+//
+
+static void ResetBins( MSR_DrawState *draw )
+{
+	MSR_TileBins *bins = draw->bins;
+	bins->job_queue_start_rt.store(0, std::memory_order_relaxed);
+	bins->job_queue_start_ft.store(0, std::memory_order_relaxed);
+	bins->job_queue_end.store(0, std::memory_order_relaxed);
+	RewindBinArenas(draw->bin_arenas);
+}
+
+//
+// Take a snapshot of the render state and set up the vertex chunks for a batch. The batch
+// slot must be free.
+//
+
+static void SetupBatch( MSR_ThreadRenderData *trd, MSR_Vertex *vertices, Uint32 *indices, Uint32 num_indices )
+{
+	Uint32 slot = (Uint32)(trd - thread_render_data);
+	MSR_ThreadRenderData *prev = &thread_render_data[ (slot + MSR_BATCH_SLOTS - 1) % MSR_BATCH_SLOTS ];
+
+	MSR_DrawState &draw = trd->draw;
+	SnapshotDrawState(&draw, slot);
+	draw.prev_bins = ( prev->draw.target == set_render_target ) ? prev->draw.bins : NULL;
+	ResetBins(&draw);
+
+	trd->stages = JOB_STAGE_VERTEX | JOB_STAGE_RASTER;
+	trd->vertices = vertices;
+	trd->indices = indices;
+	trd->num_indices = num_indices;
+	trd->draw_id = draw_count;
+	trd->chunk_base = 0;
+	trd->num_chunks = (num_indices / 3 + trd->chunk_size - 1) / trd->chunk_size;
+	trd->next_chunk.store(0, std::memory_order_relaxed);
+
+	for( Uint32 i=0; i<trd->num_chunks; i++ )
+		trd->chunk_done[i].store(0, std::memory_order_relaxed);
+}
+
 void MSR_DrawTrianglesBatchSerial( MSR_Vertex *vertices, Uint32 num_vertices, Uint32 *indices, Uint32 num_indices ) 
 {
-	thread_render_data->indices = indices;
+	// The work threads may still be busy with the batches in flight
+	MSR_ThreadsSync();
 
-	MSR_ThreadRenderPartition *partitions = thread_render_data->partitions;
-	partitions[0].start_index = 0;
-	partitions[0].end_index = num_indices;
-	job_queue_start_rt = job_queue_start_ft = job_queue_end = 0;
-	vertex_buffer_size[0] = 0;
+	MSR_ThreadRenderData *trd = MSR_ThreadsNextJob();
+	SetupBatch(trd, vertices, indices, num_indices);
 
 	//
 	// Since we are the only thread, process all data at once.
 	// 
 
-	ProcessTrianglesV(0);
-	ProcessTrianglesR(0);
-	ProcessFragments(0);
+	ProcessTrianglesV(trd, 0);
+	BuildTileJobs(trd);
+	ProcessTrianglesR(trd, 0);
+	ProcessFragments(trd, 0);
+	render_stats.split_tiles += trd->split_tiles;
 }
 
 void MSR_DrawTrianglesBatchParallel( MSR_Vertex *vertices, Uint32 num_vertices, Uint32 *indices, Uint32 num_indices ) 
 {
-	// Split up the indices evenly among threads
-	Uint32 indices_per_thread = (num_indices / (3 * num_work_threads)) * 3;
-	Uint32 tris_left_over = (num_indices % (3 * num_work_threads)) / 3;
-	thread_render_data->indices = indices;
-
-	// Setup the main thread partition
-	MSR_ThreadRenderPartition *partitions = thread_render_data->partitions;
-	partitions[0].start_index = 0;
-	partitions[0].end_index = indices_per_thread;
-	if( tris_left_over ) {
-		partitions[0].end_index += 3;
-		tris_left_over--;
-	}
-
-	// Setup the work thread partitions
-	for( Uint32 curr_thread=1; curr_thread<num_work_threads; curr_thread++ ) {
-		partitions[curr_thread].start_index = partitions[curr_thread-1].end_index;
-		partitions[curr_thread].end_index = partitions[curr_thread].start_index + indices_per_thread;
-		if( tris_left_over ) {
-			partitions[curr_thread].end_index += 3;
-			tris_left_over--;
-		}
-	}
-
-	// Wait for the work threads to finish.
-	while( curr_threads_working ) Sleep(0);
-	
-	job_queue_start_rt = job_queue_start_ft = job_queue_end = 0;
+	// Wait for the batch that last used this slot to finish before touching it
+	MSR_ThreadRenderData *trd = MSR_ThreadsNextJob();
+	SetupBatch(trd, vertices, indices, num_indices);
 
 	// Signal all worker threads to begin processing immediately.
-	SDL_mutexP(end_working_lock);
-	curr_threads_working = num_work_threads;
-	thread_render_data->state = THREAD_STATE_VERTEX;
-	SDL_CondBroadcast(start_working_cond);
-	SDL_mutexV(end_working_lock);
+	MSR_ThreadsStartJob(trd);
 
 	// Process our vertex data.
-	vertex_buffer_size[0] = 0;
-	ProcessTrianglesV(0);
+	ProcessTrianglesV(trd, 0);
+
+	// The workers rasterize and shade this batch while we go on to set up the next one. We pick
+	// up whatever is left of it once we need the slot again, or something waits for the frame.
+	// Unless draws are async, stay until nobody reads the caller's vertices and indices anymore,
+	// and help with the early raster meanwhile.
+	MSR_ThreadsVertexBarrier(trd, 0, !async_draws);
+}
+
+//
+// Rasterize and shade everything binned in the deferred frame. Every tile is drawn once, with
+// all the draws that touched it in submission order.
+//
+
+static void DrawFrame()
+{
+	MSR_ThreadRenderData *trd = &frame_data;
+	if( !trd->num_draws )
+		return;
+
+	// Nothing else may be drawing to the target, and the vertex passes are all done
+	MSR_ThreadsSync();
+	assert( trd->num_draws <= MSR_VISIBILITY_MAX_DRAWS );
+
+	trd->stages = JOB_STAGE_RASTER;
+	BuildTileJobs(trd);
+
+	if( num_work_threads > 1 ) {
+		MSR_ThreadsStartJob(trd);
+		MSR_ThreadsRetireJob(trd);
+	} else {
+		ProcessTrianglesR(trd, 0);
+		ProcessFragments(trd, 0);
+		render_stats.split_tiles += trd->split_tiles;
+	}
+
+	trd->num_draws = 0;
+	trd->num_chunks = 0;
+}
+
+//
+// Draw whatever the deferred frame holds and wait for all rendering to finish
+//
 
-	// If we are the last, prepare the job queue and signal all threads to begin processing the jobs immediately.
-	Uint32 new_value = InterlockedDecrement(&curr_threads_working);
-	if( !new_value ) { 
+void MSR_FlushFrame()
+{
+	DrawFrame();
+	MSR_ThreadsSync();
+}
+
+//
+// Transform and bin a batch into the deferred frame. Each pass records the render state in
+// the frame and appends its chunks after the ones already there. If the vertex buffers fill
+// up before the end of the batch, the frame so far is drawn and binning starts over empty.
+//
 
-		// Signal other threads to begin rasterization
-		InterlockedExchange(&curr_threads_working, num_work_threads);
-		thread_render_data->state = THREAD_STATE_RASTER;
+void MSR_DrawTrianglesDeferred( MSR_Vertex *vertices, Uint32 num_vertices, Uint32 *indices, Uint32 num_indices ) 
+{
+	// Only solid fill is rasterized, so there is nothing to bin
+	if( render_context.fill_mode != MSR_FILL_SOLID )
+		return;
 
-	} else
-		while( THREAD_STATE_VERTEX == thread_render_data->state ) Sleep(0);
+	MSR_ThreadRenderData *trd = &frame_data;
+	Uint32 chunk_indices = trd->chunk_size * 3;
 
-	// Rasterize our triangles.
-	ProcessTrianglesR(0);
+	Uint32 done = 0;
+	while( done < num_indices )
+	{
+		if( trd->num_draws == MSR_FRAME_MAX_DRAWS || trd->num_chunks == MSR_VERTEX_MAX_CHUNKS )
+			DrawFrame();
+
+		if( !trd->num_draws ) {
+			MSR_ThreadsSync();
+			SnapshotDrawState(&trd->draw, 0);
+			trd->draw.prev_bins = NULL;
+			ResetBins(&trd->draw);
+		}
 
-	// Process our fragment data
-	ProcessFragments(0);
+		Uint32 pass_chunks = ((num_indices - done) / 3 + trd->chunk_size - 1) / trd->chunk_size;
+		pass_chunks = min( pass_chunks, MSR_VERTEX_MAX_CHUNKS - trd->num_chunks );
+
+		Uint32 draw_idx = trd->num_draws++;
+		SnapshotDrawState(&trd->draws[draw_idx], 0);
+		trd->draws[draw_idx].prev_bins = NULL;
+		trd->draws[draw_idx].draw_idx = draw_idx;
+		trd->draw = trd->draws[draw_idx];
+
+		Uint32 base = trd->num_chunks;
+		for( Uint32 i=0; i<pass_chunks; i++ )
+			trd->chunk_draw[base + i] = draw_idx;
+
+		trd->stages = JOB_STAGE_VERTEX;
+		trd->vertices = vertices;
+		trd->indices = &indices[done];
+		trd->num_indices = min( pass_chunks * chunk_indices, num_indices - done );
+		trd->draw_id = draw_count;
+		trd->chunk_base = base;
+		trd->num_chunks = base + pass_chunks;
+		trd->next_chunk.store(base, std::memory_order_relaxed);
+
+		if( num_work_threads > 1 && (trd->num_indices / (3*num_work_threads)) ) {
+			MSR_ThreadsStartJob(trd);
+			ProcessTrianglesV(trd, 0);
+			MSR_ThreadsRetireJob(trd);
+		} else {
+			ProcessTrianglesV(trd, 0);
+		}
 
-	InterlockedDecrement(&curr_threads_working);
+		// Chunks nobody had the room to take wait for the next frame
+		Uint32 handed = min( trd->next_chunk.load(std::memory_order_relaxed), trd->num_chunks );
+		done += min( (handed - base) * chunk_indices, trd->num_indices );
+		if( handed < trd->num_chunks ) {
+			trd->num_chunks = handed;
+			DrawFrame();
+		}
+	}
 }
 
 MSRAPI void MSR_DrawTriangles( MSR_Vertex *vertices, Uint32 num_vertices, Uint32 *indices, Uint32 num_indices )
 {	
-	// Clear out the vertex caches
-	for( Uint32 i=0; i<num_work_threads; i++ )
-		for( Uint32 j=0; j<MSR_VERTEX_CACHE_SIZE; j++ ) vertex_cache[i][j].tag = UINT_MAX;
+	// New draw call, so the vertex caches are stale
+	draw_count++;
 
 	// Compute the current world * view * matrix transform 
 	MSR_ShaderGlobals &globals = render_context.globals;
@@ -556,12 +1381,11 @@ MSRAPI void MSR_DrawTriangles( MSR_Vertex *vertices, Uint32 num_vertices, Uint32
 		}
 	}
 
-	PrepareRasterizer();
-	thread_render_data->vertices = vertices;
-
 	// Figure the right draw call to make
 	void (*DrawTrianglesPtr)(MSR_Vertex *vertices, Uint32 num_vertices, Uint32 *indices, Uint32 num_indices );
-	if( num_work_threads > 1 && (num_indices / (3*num_work_threads)) ) 
+	if( deferred_frame )
+		DrawTrianglesPtr = &MSR_DrawTrianglesDeferred;
+	else if( num_work_threads > 1 && (num_indices / (3*num_work_threads)) ) 
 		DrawTrianglesPtr = &MSR_DrawTrianglesBatchParallel;
 	else 
 		DrawTrianglesPtr = &MSR_DrawTrianglesBatchSerial;
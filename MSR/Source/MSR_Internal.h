@@ -30,22 +30,30 @@
 
 #define CLIP_BUFFER_SIZE 2*6+1
 
-MSRAPI void ProcessTrianglesV( Uint32 thread_id );
-MSRAPI void ProcessTrianglesR( Uint32 thread_id );
-MSRAPI void ProcessFragments( Uint32 thread_id );
-MSRAPI void ClipTriangle( MSR_TransformedVertex *v, Uint32 thread_id );
-MSRAPI void InsertTransformedTriangle(MSR_TransformedVertex *v0, MSR_TransformedVertex *v1, MSR_TransformedVertex *v2, Uint32 thread_id);
+MSRAPI void ProcessTrianglesV( MSR_ThreadRenderData *trd, Uint32 thread_id );
+MSRAPI void ProcessTrianglesR( MSR_ThreadRenderData *trd, Uint32 thread_id );
+MSRAPI void ProcessFragments( MSR_ThreadRenderData *trd, Uint32 thread_id );
+MSRAPI void ClipTriangle( MSR_DrawState *state, MSR_TransformedVertex *v, Uint32 thread_id );
+MSRAPI void InsertTransformedTriangle(MSR_DrawState *state, MSR_TransformedVertex *v0, MSR_TransformedVertex *v1, MSR_TransformedVertex *v2, Uint32 thread_id);
 
 // G L O B A L S //////////////////////////////////////////////////////
 
 // Max threads working
-extern volatile Uint32 num_work_threads;
+extern Uint32 num_work_threads;
 
-// Vertex buffer
-extern MSR_TransformedVertex **vertex_buffer;
-extern Uint32 *vertex_buffer_size;
+// Shade tiles right as they are rasterized
+extern bool fused_tiles;
 
-// Face buffer
-extern MSR_TransformedFace **face_buffer;
+// Bin all draws up to the end of the scene and rasterize them at once
+extern bool deferred_frame;
+
+// Hand out the heaviest tile jobs first, off with MSR_INIT_UNSORTED_JOBS to measure what it buys
+extern bool sort_tile_jobs;
+
+// Split hot tiles into sub-tile jobs, off with MSR_INIT_NO_TILE_SPLIT to measure what it buys
+extern bool split_hot_tiles;
+
+// Let draws return before the workers are through with the caller's vertices and indices
+extern bool async_draws;
 
 #endif
@@ -19,15 +19,11 @@
 ///////////////////////////////////////////////////////////////////////
 
 #include "MSR_Render.h"
+#include "MSR_Threads.h"
+#include <malloc.h>
+#include <float.h>
 
-// Face Buffer
-extern MSR_TransformedFace **face_buffer;
-extern volatile Uint32 num_work_threads;
-extern volatile Uint32 curr_threads_working;
-
-#define SYNC_THREADS() { while( curr_threads_working ) Sleep(0); }
-
-void (*RenderFragments)(MSR_FragmentBuffer *fb);
+#define SYNC_THREADS() MSR_FlushFrame()
 
 // Render Targets
 Uint32 num_render_targets = 0;
@@ -36,12 +32,13 @@ MSR_RenderTarget render_targets[MSR_MAX_RENDER_TARGETS];
 
 //
 // Render State Settings
-// 
+//
+// These only change render_context. Every batch takes its own copy of it when it is submitted,
+// so the batches in flight keep the state they were issued with and there is nothing to wait for.
+//
 
 void MSR_SetTransform(Uint32 type, const MSR_Mat4x4 &mat) 
 {
-	SYNC_THREADS();
-
 	MSR_ShaderGlobals &globals = render_context.globals;
 
 	if( type == MSR_TRANSFORM_WORLD ) {
@@ -56,52 +53,38 @@ void MSR_SetTransform(Uint32 type, const MSR_Mat4x4 &mat)
 
 void MSR_SetCullMode( Uint32 cullmode )
 {
-	SYNC_THREADS();
-
 	render_context.cull_mode = (Uint8)cullmode;
 }
 
 void MSR_SetFillMode( Uint32 fillmode )
 {
-	SYNC_THREADS();
-
 	render_context.fill_mode = (Uint8)fillmode;
 }
 
 void MSR_SetTexture( SDL_Surface *tex ) 
 {
-	SYNC_THREADS();
-
 	render_context.globals.tex0 = tex;
 }
 
 void MSR_SetMaterial( MSR_Material *mat ) 
 {
-	SYNC_THREADS();
-
 	memcpy(&render_context.globals.material,mat,sizeof(MSR_Material));
 }
 
 void MSR_SetLight( MSR_Light *light, Uint32 stage ) 
 {
-	SYNC_THREADS();
-
 	if( stage < MSR_MAX_LIGHTS ) 
 		memcpy(&render_context.globals.lights[stage],light,sizeof(MSR_Light));
 }
 
 void MSR_SetLightEnabled( Uint32 stage, bool on )
 {
-	SYNC_THREADS();
-
 	if( stage < MSR_MAX_LIGHTS )
 		render_context.globals.lights_enabled[stage] = on;
 }
 
 void MSR_SetZBufferEnabled( bool on )
 {
-	SYNC_THREADS();
-
 	if( on && !set_render_target->z_buffer ) return;
 
 	render_context.depth_enabled = on;
@@ -109,58 +92,206 @@ void MSR_SetZBufferEnabled( bool on )
 
 void MSR_SetBackBufferEnabled( bool on )
 {
-	SYNC_THREADS();
-
 	render_context.color_enabled = on;
 }
 
-void MSR_SetNumVaryings( Uint32 varyings )
+void MSR_SetGuardBand( Uint32 pixels )
 {
-	SYNC_THREADS();
+	render_context.guard_band = pixels;
+}
 
+void MSR_SetNumVaryings( Uint32 varyings )
+{
 	render_context.num_varyings = varyings;
 }
 
 void MSR_SetVertexShader( void (*vs)(MSR_VShaderParameters *params) )
 {
-	SYNC_THREADS();
-
 	render_context.VertexShader = vs;
 }
 
 void MSR_SetFragmentShader( void (*fs)(MSR_FShaderParameters *params) )
 {
-	SYNC_THREADS();
-
 	render_context.FragmentShader = fs;
+	render_context.FragmentShader8 = NULL;
+}
+
+void MSR_SetFragmentShader8( void (*fs)(MSR_FShaderParameters8 *params) )
+{
+	render_context.FragmentShader8 = fs;
 }
 
 void MSR_BeginScene() 
 {
 	SYNC_THREADS();
+}
+
+//
+// The colour tiles hold X8R8G8B8 whatever the target is. 16-bit targets are converted with their
+// format when the tiles are filled from them and resolved to them.
+//
 
-	SDL_LockSurface(set_render_target->back_buffer);
-	if( set_render_target->z_buffer )
-		SDL_LockSurface(set_render_target->z_buffer);
+static inline Uint16 PackPixel16( const SDL_PixelFormat *f, Uint32 c )
+{
+	return (Uint16)( ((((c >> 16) & 0xff) >> f->Rloss) << f->Rshift) |
+					 ((((c >> 8) & 0xff) >> f->Gloss) << f->Gshift) |
+					 (((c & 0xff) >> f->Bloss) << f->Bshift) );
+}
+
+static inline Uint32 UnpackPixel16( const SDL_PixelFormat *f, Uint16 p )
+{
+	return ((((p & f->Rmask) >> f->Rshift) << f->Rloss) << 16) |
+		   ((((p & f->Gmask) >> f->Gshift) << f->Gloss) << 8) |
+		   (((p & f->Bmask) >> f->Bshift) << f->Bloss);
+}
+
+//
+// Copy a tiled buffer out to a surface of the target's size. The pieces whose clear was put off
+// (clear_shift selects colour or depth) are filled with value instead. The surface is only ever
+// written here, so the rows that line up go around the cache. Only colour surfaces can be 16-bit.
+//
+
+static void ResolveTiles( const MSR_RenderTarget *rt, const Uint32 *tiles, SDL_Surface *surface, Uint32 clear_shift, Uint32 value )
+{
+	Uint32 width = rt->back_buffer->clip_rect.w;
+	Uint32 height = rt->back_buffer->clip_rect.h;
+	bool pixel16 = surface->format->BytesPerPixel == 2;
+	__m128i fill = _mm_set1_epi32(value);
+
+	SDL_LockSurface(surface);
+
+	for( Uint32 y=0; y<height; y++ )
+	{
+		Uint8 *line = (Uint8*)surface->pixels + y * surface->pitch;
+		const MSR_AtomicU32 *tile_clear = rt->tile_clear + (y >> MSR_SCREEN_TILE_SIZE_SHIFT) * rt->num_tiles_x;
+		Uint32 row_shift = clear_shift + ((y & (MSR_SCREEN_TILE_SIZE - 1)) >> MSR_CLEAR_BLOCK_SHIFT) * MSR_CLEAR_TILE_BLOCKS;
+
+		for( Uint32 x=0; x<width; x+=MSR_CLEAR_BLOCK_SIZE )
+		{
+			Uint32 cleared = tile_clear[x >> MSR_SCREEN_TILE_SIZE_SHIFT].load(std::memory_order_relaxed) >>
+							 ( row_shift + ((x & (MSR_SCREEN_TILE_SIZE - 1)) >> MSR_CLEAR_BLOCK_SHIFT) );
+			const Uint32 *src = tiles + MSR_TiledOffset(rt, x, y);
+			Uint32 n = min(width - x, (Uint32)MSR_CLEAR_BLOCK_SIZE);
+			Uint32 i = 0;
+
+			if( pixel16 ) {
+				Uint16 *dst = (Uint16*)line + x;
+				for( ; i<n; i++ )
+					dst[i] = PackPixel16(surface->format, (cleared & 1) ? value : src[i]);
+				continue;
+			}
+
+			Uint32 *dst = (Uint32*)line + x;
+			if( !((size_t)dst & 15) ) {
+				for( ; i+4<=n; i+=4 )
+					_mm_stream_si128((__m128i*)(dst + i), (cleared & 1) ? fill : _mm_load_si128((const __m128i*)(src + i)));
+			}
+			for( ; i<n; i++ )
+				dst[i] = (cleared & 1) ? value : src[i];
+		}
+	}
+	_mm_sfence();
+
+	SDL_UnlockSurface(surface);
+}
+
+//
+// Fill the pieces of a tile that are still waiting on a clear, for the region of a job that is
+// about to shade it. Jobs on a tile never overlap, and the next batch only gets to the tile
+// once they are all through.
+//
+
+static void FillClearBlock( Uint32 *block, Uint32 value )
+{
+	__m128i v = _mm_set1_epi32(value);
+	for( Uint32 y=0; y<MSR_CLEAR_BLOCK_SIZE; y++, block += MSR_SCREEN_TILE_SIZE )
+		for( Uint32 x=0; x<MSR_CLEAR_BLOCK_SIZE; x+=4 )
+			_mm_store_si128((__m128i*)(block + x), v);
+}
+
+void PrepareTileJob( MSR_RenderTarget *target, const MSR_TileJob &job )
+{
+	MSR_AtomicU32 &tile_clear = target->tile_clear[job.tile_idx];
+	if( !tile_clear.load(std::memory_order_relaxed) )
+		return;
+
+	Uint32 bx0 = (job.x & (MSR_SCREEN_TILE_SIZE - 1)) >> MSR_CLEAR_BLOCK_SHIFT;
+	Uint32 by0 = (job.y & (MSR_SCREEN_TILE_SIZE - 1)) >> MSR_CLEAR_BLOCK_SHIFT;
+	Uint32 bx1 = ((job.x + job.width) & (MSR_SCREEN_TILE_SIZE - 1)) >> MSR_CLEAR_BLOCK_SHIFT;
+	Uint32 by1 = ((job.y + job.height) & (MSR_SCREEN_TILE_SIZE - 1)) >> MSR_CLEAR_BLOCK_SHIFT;
+
+	Uint32 mask = 0;
+	for( Uint32 by=by0; by<=by1; by++ )
+		for( Uint32 bx=bx0; bx<=bx1; bx++ )
+			mask |= 1 << (by * MSR_CLEAR_TILE_BLOCKS + bx);
+	mask |= mask << MSR_CLEAR_DEPTH_SHIFT;
+
+	Uint32 cleared = tile_clear.fetch_and(~mask, std::memory_order_relaxed) & mask;
+	if( !cleared )
+		return;
+
+	Uint32 tile_offset = job.tile_idx << (2 * MSR_SCREEN_TILE_SIZE_SHIFT);
+	for( Uint32 by=by0; by<=by1; by++ )
+	{
+		for( Uint32 bx=bx0; bx<=bx1; bx++ )
+		{
+			Uint32 bit = by * MSR_CLEAR_TILE_BLOCKS + bx;
+			Uint32 offset = tile_offset + ((by * MSR_SCREEN_TILE_SIZE + bx) << MSR_CLEAR_BLOCK_SHIFT);
+			if( cleared & (1 << bit) )
+				FillClearBlock(target->color_tiles + offset, target->clear_color);
+			if( cleared & (1 << (bit + MSR_CLEAR_DEPTH_SHIFT)) )
+				FillClearBlock((Uint32*)target->depth_tiles + offset, 0);
+		}
+	}
+}
+
+//
+// Reset the hierarchical Z to match a cleared Z-buffer
+//
+
+static void ClearHiZ( MSR_RenderTarget *rt )
+{
+	if( !rt->hiz_blocks ) return;
+
+	Uint32 num_blocks = rt->num_tiles * MSR_HIZ_TILE_BLOCKS * MSR_HIZ_TILE_BLOCKS;
+	for( Uint32 i=0; i<num_blocks; i++ )
+		MSR_HiZStore(rt->hiz_blocks[i], 0.0f);
+	for( Uint32 i=0; i<rt->num_tiles; i++ )
+		MSR_HiZStore(rt->hiz_tiles[i], 0.0f);
 }
 
 void MSR_Clear(Uint32 flags, Uint32 color) 
 {
 	SYNC_THREADS();
 
-	if( flags & MSR_CLEAR_TARGET )
-		SDL_FillRect(set_render_target->back_buffer,NULL,color);
-	if( flags & MSR_CLEAR_ZBUFFER ) 
-		SDL_FillRect(set_render_target->z_buffer,NULL,0);
+	// Only mark the tiles, they are filled when they are first shaded or resolved
+	Uint32 bits = 0;
+	if( flags & MSR_CLEAR_TARGET ) {
+		set_render_target->clear_color = color;
+		set_render_target->color_dirty = true;
+		bits |= MSR_CLEAR_COLOR_BITS;
+	}
+	if( (flags & MSR_CLEAR_ZBUFFER) && set_render_target->depth_tiles ) {
+		set_render_target->depth_dirty = true;
+		bits |= MSR_CLEAR_DEPTH_BITS;
+		ClearHiZ(set_render_target);
+	}
+
+	if( bits ) {
+		for( Uint32 i=0; i<set_render_target->num_tiles; i++ )
+			set_render_target->tile_clear[i].fetch_or(bits, std::memory_order_relaxed);
+	}
 }
 
 void MSR_EndScene() 
 {
 	SYNC_THREADS();
 
-	SDL_UnlockSurface(set_render_target->back_buffer);
-	if( set_render_target->z_buffer )
-		SDL_UnlockSurface(set_render_target->z_buffer);
+	// The depth stays tiled until someone asks for it
+	if( set_render_target->color_dirty ) {
+		ResolveTiles(set_render_target, set_render_target->color_tiles, set_render_target->back_buffer, 0, set_render_target->clear_color);
+		set_render_target->color_dirty = false;
+	}
 }
 
 void MSR_Present() 
@@ -171,15 +302,94 @@ void MSR_Present()
 	SDL_Flip(set_render_target->back_buffer);
 }
 
+//
+// Free everything a render target holds. A target that failed part way through being created
+// is freed the same way, so whatever it did not get to has to be NULL.
+//
+
+static void FreeRenderTarget( MSR_RenderTarget &rt )
+{
+	for( Uint32 slot=0; slot<MSR_BATCH_SLOTS; slot++ ) {
+
+		MSR_TileBins &bins = rt.bins[slot];
+
+		// Clean up tiles
+		if( bins.tiles ) {
+			for( Uint32 t=0; t<rt.num_tiles; t++ ) {
+
+				SAFE_DELETE_ARRAY(bins.tiles[t].raster_cursor);
+				MSR_FragmentBufferDestroy(&bins.tiles[t].frag_buffer);
+			}
+		}
+
+		if( bins.thread_bins ) {
+			for( Uint32 i=0; i<num_work_threads; i++ )
+				SAFE_DELETE_ARRAY(bins.thread_bins[i]);
+		}
+		SAFE_DELETE_ARRAY(bins.thread_bins);
+
+		// Clean up job queue
+		SAFE_DELETE_ARRAY(bins.tiles);
+		SAFE_DELETE_ARRAY(bins.job_queue);
+		SAFE_DELETE_ARRAY(bins.jobs);
+		SAFE_DELETE_ARRAY(bins.job_ready);
+
+		for( Uint32 i=0; i<MSR_TILE_SPLIT_BUFFERS; i++ )
+			MSR_FragmentBufferDestroy( &bins.split_buffers[i] );
+	}
+
+	// Delete Z Buffer and the tiled buffers
+	if( rt.z_buffer ) {
+		SDL_FreeSurface(rt.z_buffer);
+		rt.z_buffer = NULL;
+	}
+	if( rt.depth_tiles ) {
+		_aligned_free(rt.depth_tiles);
+		rt.depth_tiles = NULL;
+	}
+	if( rt.color_tiles ) {
+		_aligned_free(rt.color_tiles);
+		rt.color_tiles = NULL;
+	}
+	SAFE_DELETE_ARRAY(rt.tile_clear);
+	SAFE_DELETE_ARRAY(rt.hiz_blocks);
+	SAFE_DELETE_ARRAY(rt.hiz_tiles);
+	if( rt.vis_ids ) {
+		_aligned_free(rt.vis_ids);
+		rt.vis_ids = NULL;
+	}
+}
+
 int MSR_CreateRenderTarget( SDL_Surface *target, Uint32 flags, Uint32 *id )
 {
+	if( !target ) return MSR_ERR_NULL_TARGET;
 	if( num_render_targets == MSR_MAX_RENDER_TARGETS ) return MSR_ERR_MAX_TARGETS;
+	if( target->format->BytesPerPixel != 2 && target->format->BytesPerPixel != 4 ) return MSR_ERR_TARGET_FORMAT;
 
 	MSR_RenderTarget &rt = render_targets[num_render_targets];
 
 	// Assign the internal back buffer pointer
 	rt.back_buffer = target;
 
+	// Nothing is allocated yet, see FreeRenderTarget
+	for( Uint32 slot=0; slot<MSR_BATCH_SLOTS; slot++ ) {
+		MSR_TileBins &bins = rt.bins[slot];
+		bins.tiles = NULL;
+		bins.thread_bins = NULL;
+		bins.job_queue = NULL;
+		bins.jobs = NULL;
+		bins.job_ready = NULL;
+		for( Uint32 i=0; i<MSR_TILE_SPLIT_BUFFERS; i++ )
+			bins.split_buffers[i].buffer = NULL;
+	}
+	rt.z_buffer = NULL;
+	rt.color_tiles = NULL;
+	rt.depth_tiles = NULL;
+	rt.tile_clear = NULL;
+	rt.hiz_blocks = NULL;
+	rt.hiz_tiles = NULL;
+	rt.vis_ids = NULL;
+
 	//
 	// Allocate tiles
 	//
@@ -197,55 +407,147 @@ int MSR_CreateRenderTarget( SDL_Surface *target, Uint32 flags, Uint32 *id )
 	if( extra_pixels_y ) rt.num_tiles_y++;
 
 	rt.num_tiles = rt.num_tiles_x * rt.num_tiles_y;
-	rt.tiles = new MSR_Tile[ rt.num_tiles ];
 
-	//
-	// Setup tile sizes and positions
-	//
+	// Widest guard band, in steps of 16 pixels, that keeps the 28.4 edge functions in range. An
+	// edge spans at most the target and the guard band on either side, and is stepped up to
+	// MSR_EDGE_REACH from where it was rebased.
+	Uint64 size = max(target->clip_rect.w, target->clip_rect.h);
+	if( 2 * (16 * size) * (16 * MSR_EDGE_REACH) > MSR_EDGE_CLAMP ) return MSR_ERR_TARGET_SIZE;
+	rt.guard_band_max = 0;
+	for( Uint64 guard=0; 2 * (16 * (size + 2 * guard)) * (16 * MSR_EDGE_REACH) <= MSR_EDGE_CLAMP; guard += 16 )
+		rt.guard_band_max = (Uint32)guard;
 
-	Uint32 x,y;
-	for( y=0; y<rt.num_tiles_y; y++ ) {
+	// Every batch slot gets its own bins
+	for( Uint32 slot=0; slot<MSR_BATCH_SLOTS; slot++ ) {
 
-		// Is this the last tile in the y, and does it have less pixels?
-		bool edge_y = (y==(rt.num_tiles_y-1) && extra_pixels_y);
+		MSR_TileBins &bins = rt.bins[slot];
+		bins.tiles = new MSR_Tile[ rt.num_tiles ];
 
-		for( x=0; x<rt.num_tiles_x; x++ ) {
+		//
+		// Setup tile sizes and positions
+		//
 
-			// Is this the last tile in the x, and does it have less pixels?
-			bool edge_x = (x==(rt.num_tiles_x-1) && extra_pixels_x);
+		Uint32 x,y;
+		for( y=0; y<rt.num_tiles_y; y++ ) {
 
-			// Fill in the tile info
-			MSR_Tile *t			 = &rt.tiles[y*rt.num_tiles_x+x];
-			t->frag_tiles		 = new Uint8*[num_work_threads];
-			t->index_buffer		 = new Uint32*[num_work_threads];
-			t->index_buffer_size = new Uint32[num_work_threads];
+			// Is this the last tile in the y, and does it have less pixels?
+			bool edge_y = (y==(rt.num_tiles_y-1) && extra_pixels_y);
 
-			for( Uint32 i=0; i<num_work_threads; i++ ) {
-				t->index_buffer_size[i] = 0;
-				t->index_buffer[i] = new Uint32[ MSR_BIN_TRIANGLE_QUEUE_SIZE / num_work_threads ];
-				t->frag_tiles[i] = new Uint8[ MSR_BIN_TRIANGLE_QUEUE_SIZE / (num_work_threads * 3) ];
-			}
+			for( x=0; x<rt.num_tiles_x; x++ ) {
+
+				// Is this the last tile in the x, and does it have less pixels?
+				bool edge_x = (x==(rt.num_tiles_x-1) && extra_pixels_x);
+
+				// Fill in the tile info
+				MSR_Tile *t			 = &bins.tiles[y*rt.num_tiles_x+x];
+				t->raster_cursor	 = new MSR_BinCursor[num_work_threads];
+				t->job_cost			 = 0;
+
+				for( Uint32 i=0; i<num_work_threads; i++ ) {
+					t->raster_cursor[i].chunk = NULL;
+					t->raster_cursor[i].pos = 0;
+				}
 
-			t->width			 = !edge_x ? MSR_SCREEN_TILE_SIZE-1 : extra_pixels_x-1;
-			t->height			 = !edge_y ? MSR_SCREEN_TILE_SIZE-1 : extra_pixels_y-1;
-			t->x				 = x * MSR_SCREEN_TILE_SIZE;
-			t->y				 = y * MSR_SCREEN_TILE_SIZE;
-			t->dirty			 = 0;
+				t->width			 = !edge_x ? MSR_SCREEN_TILE_SIZE-1 : extra_pixels_x-1;
+				t->height			 = !edge_y ? MSR_SCREEN_TILE_SIZE-1 : extra_pixels_y-1;
+				t->x				 = x * MSR_SCREEN_TILE_SIZE;
+				t->y				 = y * MSR_SCREEN_TILE_SIZE;
+				t->dirty.store(0, std::memory_order_relaxed);
+				t->raster_progress.store(0, std::memory_order_relaxed);
+				t->raster_lock.store(0, std::memory_order_relaxed);
+				t->shade_pending.store(0, std::memory_order_relaxed);
+
+				MSR_FragmentBufferInit( &t->frag_buffer );
+				t->frag_buffer.x = t->x;
+				t->frag_buffer.y = t->y;
+			}
+		}
 
-			MSR_FragmentBufferInit( &t->frag_buffer );
+		// Thread-major bins
+		bins.thread_bins = new MSR_TileBin*[num_work_threads]();
+		for( Uint32 i=0; i<num_work_threads; i++ ) {
+			bins.thread_bins[i] = new MSR_TileBin[rt.num_tiles];
+			for( Uint32 t=0; t<rt.num_tiles; t++ ) {
+				bins.thread_bins[i][t].head = NULL;
+				bins.thread_bins[i][t].tail = NULL;
+				bins.thread_bins[i][t].size.store(0, std::memory_order_relaxed);
+				bins.thread_bins[i][t].cost = 0;
+			}
 		}
+
+		// Create the job queue. Splitting a tile adds at most one job per split buffer.
+		bins.job_queue = new Uint32[rt.num_tiles];
+		bins.jobs = new MSR_TileJob[rt.num_tiles + MSR_TILE_SPLIT_BUFFERS];
+		bins.job_ready = new MSR_AtomicU32[rt.num_tiles + MSR_TILE_SPLIT_BUFFERS];
+		bins.num_jobs = 0;
+		bins.job_queue_start_rt.store(0, std::memory_order_relaxed);
+		bins.job_queue_start_ft.store(0, std::memory_order_relaxed);
+		bins.job_queue_end.store(0, std::memory_order_relaxed);
+
+		for( Uint32 i=0; i<MSR_TILE_SPLIT_BUFFERS; i++ )
+			MSR_FragmentBufferInit( &bins.split_buffers[i] );
 	}
 
-	// Create the job queue
-	rt.job_queue = new Uint32[rt.num_tiles_x*rt.num_tiles_y];
+	// Tiled colour, starting out as whatever the surface holds
+	Uint32 tiled_size = rt.num_tiles * MSR_SCREEN_TILE_SIZE * MSR_SCREEN_TILE_SIZE;
+	rt.color_tiles = (Uint32*)_aligned_malloc(sizeof(Uint32) * tiled_size, MSR_CACHE_LINE_SIZE);
+	if( !rt.color_tiles ) {
+		FreeRenderTarget(rt);
+		return MSR_ERR_LOW_MEMORY;
+	}
+	ZeroMemory(rt.color_tiles, sizeof(Uint32) * tiled_size);
+	SDL_LockSurface(target);
+	for( Uint32 y=0; y<(Uint32)target->clip_rect.h; y++ ) {
+		Uint8 *line = (Uint8*)target->pixels + y * target->pitch;
+		for( Uint32 x=0; x<(Uint32)target->clip_rect.w; x++ )
+			rt.color_tiles[MSR_TiledOffset(&rt, x, y)] = target->format->BytesPerPixel == 4 ? ((Uint32*)line)[x] : UnpackPixel16(target->format, ((Uint16*)line)[x]);
+	}
+	SDL_UnlockSurface(target);
+	rt.color_dirty = false;
+	rt.clear_color = 0;
+
+	// Nothing waits on a clear yet, the depth is cleared below
+	rt.tile_clear = new MSR_AtomicU32[rt.num_tiles];
+	for( Uint32 i=0; i<rt.num_tiles; i++ )
+		rt.tile_clear[i].store(0, std::memory_order_relaxed);
 
-	// Create the Z-Buffer
+	// Create the Z-Buffer, tiled for drawing and a surface to hand out
 	if( flags & MSR_INIT_ZBUFFER ) {
 		rt.z_buffer = SDL_CreateRGBSurface(0,rt.back_buffer->w,rt.back_buffer->h,32,0,0,0,0);
-		if( !rt.z_buffer ) 
+		if( !rt.z_buffer ) {
+			FreeRenderTarget(rt);
+			return MSR_ERR_LOW_MEMORY;
+		}
+		rt.depth_tiles = (float*)_aligned_malloc(sizeof(float) * tiled_size, MSR_CACHE_LINE_SIZE);
+		if( !rt.depth_tiles ) {
+			FreeRenderTarget(rt);
 			return MSR_ERR_LOW_MEMORY;
+		}
+		ZeroMemory(rt.depth_tiles, sizeof(float) * tiled_size);
+		for( Uint32 i=0; i<rt.num_tiles; i++ )
+			rt.tile_clear[i].store(MSR_CLEAR_DEPTH_BITS, std::memory_order_relaxed);
+		rt.depth_dirty = true;
+
+		// Hierarchical Z over whole tiles, starting out cleared like the Z-buffer
+		rt.hiz_pitch = rt.num_tiles_x * MSR_HIZ_TILE_BLOCKS;
+		rt.hiz_blocks = new MSR_AtomicU32[rt.num_tiles * MSR_HIZ_TILE_BLOCKS * MSR_HIZ_TILE_BLOCKS];
+		rt.hiz_tiles = new MSR_AtomicU32[rt.num_tiles];
+		ClearHiZ(&rt);
 	} else {
-		rt.z_buffer = NULL;
+		rt.depth_dirty = false;
+	}
+
+	// Visibility buffer over whole tiles, with nothing seen yet
+	if( visibility_buffer ) {
+		rt.vis_pitch = rt.num_tiles_x * MSR_SCREEN_TILE_SIZE;
+		Uint32 vis_size = rt.vis_pitch * rt.num_tiles_y * MSR_SCREEN_TILE_SIZE;
+		rt.vis_ids = (Uint32*)_aligned_malloc(sizeof(Uint32) * vis_size, 16);
+		if( !rt.vis_ids ) {
+			FreeRenderTarget(rt);
+			return MSR_ERR_LOW_MEMORY;
+		}
+		for( Uint32 i=0; i<vis_size; i++ )
+			rt.vis_ids[i] = MSR_VISIBILITY_NONE;
 	}
 
 	*id = num_render_targets++;
@@ -256,31 +558,14 @@ int MSR_CreateRenderTarget( SDL_Surface *target, Uint32 flags, Uint32 *id )
 void MSR_DestroyRenderTarget( Uint32 id )
 {
 	if( id >= MSR_MAX_RENDER_TARGETS ) return;
-	MSR_RenderTarget &rt = render_targets[id];
-
-	// Clean up tiles
-	for( Uint32 t=0; t<rt.num_tiles_x*rt.num_tiles_y; t++ ) {
 
-		for( Uint32 i=0; i<num_work_threads; i++ ) {
-			SAFE_DELETE_ARRAY(rt.tiles[t].index_buffer[i]);
-			SAFE_DELETE_ARRAY(rt.tiles[t].frag_tiles[i]);
-		}
-
-		SAFE_DELETE_ARRAY(rt.tiles[t].index_buffer_size);
-		SAFE_DELETE_ARRAY(rt.tiles[t].frag_tiles);
-		MSR_FragmentBufferDestroy(&rt.tiles[t].frag_buffer);
-	}
-
-	// Clean up job queue
-	SAFE_DELETE_ARRAY(rt.tiles);
-	SAFE_DELETE_ARRAY(rt.job_queue);
-
-	// Delete Z Buffer
-	if( rt.z_buffer ) SDL_FreeSurface(rt.z_buffer);
+	FreeRenderTarget(render_targets[id]);
 }
 
 void MSR_SetRenderTarget( Uint32 id )
 {
+	// Shaders may read a target's buffers once it is switched away from (e.g. a shadow map),
+	// so it has to be finished first
 	SYNC_THREADS();
 
 	if( id >= MSR_MAX_RENDER_TARGETS ) return;
@@ -291,14 +576,22 @@ void MSR_SetRenderTarget( Uint32 id )
 void MSR_GetRenderTargetDepth( Uint32 id, SDL_Surface **depth )
 {
 	if( id >= MSR_MAX_RENDER_TARGETS ) return;
+	MSR_RenderTarget &rt = render_targets[id];
 
-	*depth = render_targets[id].z_buffer;
+	// Bring the surface up to date with whatever was drawn since it was last asked for
+	SYNC_THREADS();
+	if( rt.depth_dirty ) {
+		ResolveTiles(&rt, (const Uint32*)rt.depth_tiles, rt.z_buffer, MSR_CLEAR_DEPTH_SHIFT, 0);
+		rt.depth_dirty = false;
+	}
+
+	*depth = rt.z_buffer;
 }
 
-void PostProcessVertex(MSR_TransformedVertex *v_trans) 
+void PostProcessVertex(MSR_DrawState *state, MSR_TransformedVertex *v_trans) 
 {
-	float width = (float)set_render_target->back_buffer->clip_rect.w;
-	float height = (float)set_render_target->back_buffer->clip_rect.h;
+	float width = (float)state->target->back_buffer->clip_rect.w;
+	float height = (float)state->target->back_buffer->clip_rect.h;
 
 	MSR_Vec4 *pos = &v_trans->p;
 
@@ -316,7 +609,7 @@ void PostProcessVertex(MSR_TransformedVertex *v_trans)
 }
 
 template <bool useColorBuffer, bool useZBuffer>
-void RenderFragmentsGeneric(MSR_FragmentBuffer *fb) 
+void RenderFragmentsGeneric(MSR_DrawState *state, MSR_FragmentBuffer *fb) 
 {
 	//
 	// BEGIN HELPER MACROS
@@ -336,7 +629,7 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 		W1 = _mm_add_ps( W0, _mm_mul_ps( dx, C1 ) );										\
 																							\
 		/* Compute the varyings for all four pixels */										\
-		for( Uint32 i=0; i<render_context.num_varyings; i++ )								\
+		for( Uint32 i=0; i<state->context.num_varyings; i++ )								\
 		{																					\
 			MSR_Vec2 &v = face->dv[i];														\
 			base = _mm_set1_ps(face->v0v[i] + face->dv[i].x * dxstart + face->dv[i].y * dystart);	\
@@ -354,7 +647,7 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 																							\
 		if( useColorBuffer )																\
 		{																					\
-			for( Uint32 i=0; i<render_context.num_varyings; i+=2 ) {						\
+			for( Uint32 i=0; i<state->context.num_varyings; i+=2 ) {						\
 				V0[i+0] = _mm_add_ps(V0[i+0], VDY[i+0]);									\
 				V1[i+0] = _mm_add_ps(V1[i+0], VDY[i+0]);									\
 				V0[i+1] = _mm_add_ps(V0[i+1], VDY[i+1]);									\
@@ -392,7 +685,7 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 #define COMPUTE_PARAMS(params, W, V)														\
 	{																						\
 		__m128 w = _mm_rcp_ps(W);															\
-		for( Uint32 i=0; i<render_context.num_varyings; i+=2 ) {							\
+		for( Uint32 i=0; i<state->context.num_varyings; i+=2 ) {							\
 			params.varyings[i+0].f = _mm_mul_ps(w, V[i+0]);									\
 			params.varyings[i+1].f = _mm_mul_ps(w, V[i+1]);									\
 		}																					\
@@ -451,7 +744,7 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 	// 
 
 	MSR_SSE_ALIGNED MSR_FShaderParameters params;
-	params.globals = &render_context.globals;
+	params.globals = &state->context.globals;
 
 	__m128 W0, W1, WDY;
 	__m128 V0[MSR_MAX_VARYINGS], V1[MSR_MAX_VARYINGS], VDY[MSR_MAX_VARYINGS];
@@ -462,14 +755,17 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 
 	__m128i mask_mask = _mm_set_epi32(8, 4, 2, 1);
 
-	Uint32 cb_pitch = set_render_target->back_buffer->pitch / 4;
-	Uint32 db_pitch = set_render_target->z_buffer->pitch / 4;
+	// Fragments never leave their tile, so rows are a tile apart
+	Uint32 cb_pitch = MSR_SCREEN_TILE_SIZE;
+	Uint32 db_pitch = MSR_SCREEN_TILE_SIZE;
 
 	for( int elem=0; elem<fb->elements; elem++ )
 	{
 		// Get the next fragment
 		MSR_Fragment *frag = MSR_FragmentBufferGet(fb, elem);
-		MSR_TransformedFace *face = &face_buffer[frag->thread_id][frag->face_idx];
+		MSR_TransformedFace *face = &state->face_buffer[frag->thread_id][frag->face_idx];
+		Uint32 fx = fb->x + frag->x;
+		Uint32 fy = fb->y + frag->y;
 		
 		if( frag->state == MSR_FRAGMENT_STATE_BLOCK_MASK )
 		{
@@ -479,12 +775,12 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 			Uint32 *colorBuffer;
 			float *depthBuffer;
 
-			colorBuffer = (Uint32*)set_render_target->back_buffer->pixels + frag->y * cb_pitch + frag->x;
-			if( useZBuffer ) depthBuffer = (float*)set_render_target->z_buffer->pixels + frag->y * db_pitch + frag->x;
+			colorBuffer = state->target->color_tiles + MSR_TiledOffset(state->target, fx, fy);
+			if( useZBuffer ) depthBuffer = state->target->depth_tiles + MSR_TiledOffset(state->target, fx, fy);
 
 			// Get any of the vertices and compute the start delta for x and y				
-			float dxstart = (float)frag->x - face->v0x;														
-			float dystart = (float)frag->y - face->v0y;
+			float dxstart = (float)fx - face->v0x;														
+			float dystart = (float)fy - face->v0y;
 
 			// Compute the inverse W for all four pixels */	
 			__m128 dx = _mm_set1_ps(face->dw.x);
@@ -512,14 +808,14 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 			if( useColorBuffer )
 			{
 				InvW = _mm_rcp_ps( W0 );
-				for( Uint32 i=0; i<render_context.num_varyings; i++ )								
+				for( Uint32 i=0; i<state->context.num_varyings; i++ )								
 				{																			
 					dx = _mm_mul_ps( _mm_set1_ps(face->dv[i].x), C0 );					
 					base = _mm_set1_ps(face->v0v[i] + face->dv[i].x * dxstart + face->dv[i].y * dystart);							
 					params.varyings[i].f = _mm_mul_ps( _mm_add_ps( base, dx ), InvW );
 				}
 
-				render_context.FragmentShader(&params);
+				state->context.FragmentShader(&params);
 				SATURATE_RESULT(params.output, nquad);
 			}
 
@@ -544,56 +840,70 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 		{
 			if( frag->state == MSR_FRAGMENT_STATE_BLOCK )
 			{
-				float *depthBuffer;
-				Uint32 *colorBuffer = (Uint32*)set_render_target->back_buffer->pixels + frag->y * cb_pitch + frag->x;
-				if( useZBuffer ) depthBuffer = (float*)set_render_target->z_buffer->pixels + frag->y * db_pitch + frag->x;
-				SETUP_VARYINGS(frag->x, frag->y);
-
-				for( Uint32 y=0; y<8; y++ )
+				// A run of blocks to the right
+				for( Uint32 bx=fx; bx <= fx + 8 * frag->mask; bx += 8 )
 				{
-					__m128 dbquad;
-					__m128i oquad, nquad, dbmask;
-					Uint32 *cbTileLine;
-					float *dbTileLine;
+					float *depthBuffer;
+					Uint32 *colorBuffer = state->target->color_tiles + MSR_TiledOffset(state->target, bx, fy);
+					if( useZBuffer ) depthBuffer = state->target->depth_tiles + MSR_TiledOffset(state->target, bx, fy);
+					SETUP_VARYINGS(bx, fy);
 
-					LOAD_BUFFERS(W0, 0, oquad, dbquad, cbTileLine, dbTileLine, dbmask, INTERP_SB1);
+					// Farthest depth left in the block
+					__m128 zmin = _mm_set_ps1(FLT_MAX);
 
-					if( useColorBuffer )
+					for( Uint32 y=0; y<8; y++ )
 					{
-						COMPUTE_PARAMS(params, W0, V0);
-						render_context.FragmentShader(&params);
-						SATURATE_RESULT(params.output, nquad);
-					}
+						__m128 dbquad;
+						__m128i oquad, nquad, dbmask;
+						Uint32 *cbTileLine;
+						float *dbTileLine;
+
+						LOAD_BUFFERS(W0, 0, oquad, dbquad, cbTileLine, dbTileLine, dbmask, INTERP_SB1);
+
+						if( useColorBuffer )
+						{
+							COMPUTE_PARAMS(params, W0, V0);
+							state->context.FragmentShader(&params);
+							SATURATE_RESULT(params.output, nquad);
+						}
 
-					STORE_RESULT(W0, oquad, nquad, dbquad, cbTileLine, dbTileLine, dbmask);
+						STORE_RESULT(W0, oquad, nquad, dbquad, cbTileLine, dbTileLine, dbmask);
 
-				INTERP_SB1:
-					LOAD_BUFFERS(W1, 4, oquad, dbquad, cbTileLine, dbTileLine, dbmask, INTERP_SB2);
+					INTERP_SB1:
+						if( useZBuffer ) zmin = _mm_min_ps(zmin, dbquad);
+						LOAD_BUFFERS(W1, 4, oquad, dbquad, cbTileLine, dbTileLine, dbmask, INTERP_SB2);
 					
-					if( useColorBuffer )
-					{
-						COMPUTE_PARAMS(params, W1, V1);
-						render_context.FragmentShader(&params);
-						SATURATE_RESULT(params.output, nquad);
-					}
+						if( useColorBuffer )
+						{
+							COMPUTE_PARAMS(params, W1, V1);
+							state->context.FragmentShader(&params);
+							SATURATE_RESULT(params.output, nquad);
+						}
 
-					STORE_RESULT(W1, oquad, nquad, dbquad, cbTileLine, dbTileLine, dbmask);
+						STORE_RESULT(W1, oquad, nquad, dbquad, cbTileLine, dbTileLine, dbmask);
 
-				INTERP_SB2:
-					INTERPOLATE_Y();
+					INTERP_SB2:
+						if( useZBuffer ) zmin = _mm_min_ps(zmin, dbquad);
+						INTERPOLATE_Y();
+					}
+
+					if( useZBuffer ) MSR_HiZStoreBlock(state->target, bx, fy, zmin);
 				}
 			}
 			else
 			{
-				for( Uint32 by=frag->y; by < frag->y + MSR_SCREEN_TILE_SIZE; by += 8 )
+				for( Uint32 by=fy; by < fy + MSR_SCREEN_TILE_SIZE; by += 8 )
 				{
-					for( Uint32 bx=frag->x; bx < frag->x + MSR_SCREEN_TILE_SIZE; bx += 8 )
+					for( Uint32 bx=fx; bx < fx + MSR_SCREEN_TILE_SIZE; bx += 8 )
 					{
 						float *depthBuffer;
-						Uint32 *colorBuffer = (Uint32*)set_render_target->back_buffer->pixels + by * cb_pitch + bx;
-						if( useZBuffer ) depthBuffer = (float*)set_render_target->z_buffer->pixels + by * db_pitch + bx;
+						Uint32 *colorBuffer = state->target->color_tiles + MSR_TiledOffset(state->target, bx, by);
+						if( useZBuffer ) depthBuffer = state->target->depth_tiles + MSR_TiledOffset(state->target, bx, by);
 						SETUP_VARYINGS(bx, by);
 
+						// Farthest depth left in the block
+						__m128 zmin = _mm_set_ps1(FLT_MAX);
+
 						for( Uint32 y=0; y<8; y++ )
 						{
 							__m128 dbquad;
@@ -606,27 +916,31 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 							if( useColorBuffer )
 							{
 								COMPUTE_PARAMS(params, W0, V0);
-								render_context.FragmentShader(&params);
+								state->context.FragmentShader(&params);
 								SATURATE_RESULT(params.output, nquad);
 							}
 								
 							STORE_RESULT(W0, oquad, nquad, dbquad, cbTileLine, dbTileLine, dbmask);
 
 						INTERP_ST1:
+							if( useZBuffer ) zmin = _mm_min_ps(zmin, dbquad);
 							LOAD_BUFFERS(W1, 4, oquad, dbquad, cbTileLine, dbTileLine, dbmask, INTERP_ST2);
 							
 							if( useColorBuffer )
 							{
 								COMPUTE_PARAMS(params, W1, V1);
-								render_context.FragmentShader(&params);
+								state->context.FragmentShader(&params);
 								SATURATE_RESULT(params.output, nquad);
 							}
 
 							STORE_RESULT(W1, oquad, nquad, dbquad, cbTileLine, dbTileLine, dbmask);
 
 						INTERP_ST2:
+							if( useZBuffer ) zmin = _mm_min_ps(zmin, dbquad);
 							INTERPOLATE_Y();
 						}
+
+						if( useZBuffer ) MSR_HiZStoreBlock(state->target, bx, by, zmin);
 					}
 				}
 			}
@@ -641,34 +955,39 @@ void RenderFragmentsGeneric(MSR_FragmentBuffer *fb)
 #undef STORE_RESULT
 }
 
-void RasterizeTriangleSolid(Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height) 
+//
+// Test the corners of four blocks against one edge. any is set for the blocks with a corner
+// inside the edge, all for the blocks entirely inside it.
+//
+
+static __forceinline void ClassifyBlocks( __m128i e, __m128i cornerDY, __m128i cornerDX, __m128i &any, __m128i &all )
+{
+	__m128i a00 = _mm_cmpgt_epi32( e, _mm_setzero_si128() );
+	__m128i a10 = _mm_cmpgt_epi32( _mm_sub_epi32(e, cornerDY), _mm_setzero_si128() );
+	e = _mm_add_epi32( e, cornerDX );
+	__m128i a01 = _mm_cmpgt_epi32( e, _mm_setzero_si128() );
+	__m128i a11 = _mm_cmpgt_epi32( _mm_sub_epi32(e, cornerDY), _mm_setzero_si128() );
+
+	any = _mm_or_si128( _mm_or_si128(a00, a10), _mm_or_si128(a01, a11) );
+	all = _mm_and_si128( _mm_and_si128(a00, a10), _mm_and_si128(a01, a11) );
+}
+
+void RasterizeTriangleSolid(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height) 
 {
-	MSR_TransformedFace *face = &face_buffer[thread_id][face_idx];
+	MSR_TransformedFace *face = &state->face_buffer[thread_id][face_idx];
 
 	MSR_TransformedVertex *v0 = face->v[0];
 	MSR_TransformedVertex *v1 = face->v[1];
 	MSR_TransformedVertex *v2 = face->v[2];
 
-	// 28.4 fixed-point coordinates
-	const int X1 = face->fp1[0];
-	const int X2 = face->fp2[0];
-	const int X3 = face->fp3[0];
-	const int Y1 = face->fp1[1];
-	const int Y2 = face->fp2[1];
-	const int Y3 = face->fp3[1];
-
-	// Half edge constants
-	const int C1 = face->c1;
-	const int C2 = face->c2;
-	const int C3 = face->c3;
-
 	// Deltas
-	const int DX12 = X1 - X2;
-	const int DX23 = X2 - X3;
-	const int DX31 = X3 - X1;
-	const int DY12 = Y1 - Y2;
-	const int DY23 = Y2 - Y3;
-	const int DY31 = Y3 - Y1;
+	const MSR_EdgeSetup &edges = face->edges;
+	const int DX12 = edges.dx[0];
+	const int DX23 = edges.dx[1];
+	const int DX31 = edges.dx[2];
+	const int DY12 = edges.dy[0];
+	const int DY23 = edges.dy[1];
+	const int DY31 = edges.dy[2];
 
 	// Fixed-point deltas
 	const int FDX12 = DX12 << 4;
@@ -678,10 +997,10 @@ void RasterizeTriangleSolid(Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffe
 	const int FDY23 = DY23 << 4;
 	const int FDY31 = DY31 << 4;
 
-	// Pre-calculate the SSE offsets and interpolates
-	__m128i iOffsetDY12 = _mm_set_epi32(FDY12 * 3, FDY12 * 2, FDY12, 0);
-	__m128i iOffsetDY23 = _mm_set_epi32(FDY23 * 3, FDY23 * 2, FDY23, 0);
-	__m128i iOffsetDY31 = _mm_set_epi32(FDY31 * 3, FDY31 * 2, FDY31, 0);
+	// SSE offsets and interpolates
+	__m128i iOffsetDY12 = edges.offset[0];
+	__m128i iOffsetDY23 = edges.offset[1];
+	__m128i iOffsetDY31 = edges.offset[2];
 	__m128i iFDY12 = _mm_set1_epi32(FDY12 << 2);
 	__m128i iFDY23 = _mm_set1_epi32(FDY23 << 2);
 	__m128i iFDY31 = _mm_set1_epi32(FDY31 << 2);
@@ -699,49 +1018,82 @@ void RasterizeTriangleSolid(Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffe
 	minx &= ~(q - 1);
 	miny &= ~(q - 1);
 
+	// Half edge constants at that corner, everything is stepped from there
+	const int C1 = MSR_EdgeAt(edges.c[0], DX12, DY12, minx << 4, miny << 4);
+	const int C2 = MSR_EdgeAt(edges.c[1], DX23, DY23, minx << 4, miny << 4);
+	const int C3 = MSR_EdgeAt(edges.c[2], DX31, DY31, minx << 4, miny << 4);
+
+	// Blocks are classified four at a time. Offsets of the blocks in a group, of the far corners
+	// of a block, and the steps to the next group and to the next row of blocks.
+	__m128i iBlockDY12 = _mm_slli_epi32(iOffsetDY12, 3);
+	__m128i iBlockDY23 = _mm_slli_epi32(iOffsetDY23, 3);
+	__m128i iBlockDY31 = _mm_slli_epi32(iOffsetDY31, 3);
+	__m128i iCornerDY12 = _mm_set1_epi32(FDY12 * (q - 1));
+	__m128i iCornerDY23 = _mm_set1_epi32(FDY23 * (q - 1));
+	__m128i iCornerDY31 = _mm_set1_epi32(FDY31 * (q - 1));
+	__m128i iCornerDX12 = _mm_set1_epi32(FDX12 * (q - 1));
+	__m128i iCornerDX23 = _mm_set1_epi32(FDX23 * (q - 1));
+	__m128i iCornerDX31 = _mm_set1_epi32(FDX31 * (q - 1));
+	__m128i iGroupDY12 = _mm_set1_epi32(FDY12 * q * 4);
+	__m128i iGroupDY23 = _mm_set1_epi32(FDY23 * q * 4);
+	__m128i iGroupDY31 = _mm_set1_epi32(FDY31 * q * 4);
+	__m128i iRowDX12 = _mm_set1_epi32(FDX12 * q);
+	__m128i iRowDX23 = _mm_set1_epi32(FDX23 * q);
+	__m128i iRowDX31 = _mm_set1_epi32(FDX31 * q);
+
+	// Edge functions at the top left corners of the first four blocks
+	__m128i iBY1 = _mm_sub_epi32( _mm_set1_epi32(C1), iBlockDY12 );
+	__m128i iBY2 = _mm_sub_epi32( _mm_set1_epi32(C2), iBlockDY23 );
+	__m128i iBY3 = _mm_sub_epi32( _mm_set1_epi32(C3), iBlockDY31 );
+
+	// Blocks already covered by something nearer are skipped
+	const MSR_AtomicU32 *hiz = state->context.depth_enabled ? state->target->hiz_blocks : NULL;
+
 	// Loop through blocks
 	for(int y = miny; y < maxy; y += q)
 	{
-		for(int x = minx; x < maxx; x += q)
+		const MSR_AtomicU32 *hiz_row = hiz ? hiz + (y >> MSR_HIZ_BLOCK_SHIFT) * state->target->hiz_pitch : NULL;
+
+		// Classify the row of blocks, one bit per block
+		Uint32 live = 0, accept = 0;
+		__m128i iBX1 = iBY1;
+		__m128i iBX2 = iBY2;
+		__m128i iBX3 = iBY3;
+
+		for(int x = minx, bit = 0; x < maxx; x += q * 4, bit += 4)
+		{
+			__m128i any1, any2, any3, all1, all2, all3;
+			ClassifyBlocks( iBX1, iCornerDY12, iCornerDX12, any1, all1 );
+			ClassifyBlocks( iBX2, iCornerDY23, iCornerDX23, any2, all2 );
+			ClassifyBlocks( iBX3, iCornerDY31, iCornerDX31, any3, all3 );
+
+			live |= _mm_movemask_ps( _mm_castsi128_ps( _mm_and_si128( any1, _mm_and_si128(any2, any3) ) ) ) << bit;
+			accept |= _mm_movemask_ps( _mm_castsi128_ps( _mm_and_si128( all1, _mm_and_si128(all2, all3) ) ) ) << bit;
+
+			iBX1 = _mm_sub_epi32( iBX1, iGroupDY12 );
+			iBX2 = _mm_sub_epi32( iBX2, iGroupDY23 );
+			iBX3 = _mm_sub_epi32( iBX3, iGroupDY31 );
+		}
+
+		iBY1 = _mm_add_epi32( iBY1, iRowDX12 );
+		iBY2 = _mm_add_epi32( iBY2, iRowDX23 );
+		iBY3 = _mm_add_epi32( iBY3, iRowDX31 );
+
+		for(int x = minx, bit = 1; x < maxx; x += q, bit <<= 1)
 		{
-			// Corners of block
-			int x0 = x << 4;
-			int x1 = (x + q - 1) << 4;
-			int y0 = y << 4;
-			int y1 = (y + q - 1) << 4;
-
-			// Evaluate half-space functions
-			bool a00 = C1 + DX12 * y0 - DY12 * x0 > 0;
-			bool a10 = C1 + DX12 * y0 - DY12 * x1 > 0;
-			bool a01 = C1 + DX12 * y1 - DY12 * x0 > 0;
-			bool a11 = C1 + DX12 * y1 - DY12 * x1 > 0;
-			int a = (a00 << 0) | (a10 << 1) | (a01 << 2) | (a11 << 3);
-
-			bool b00 = C2 + DX23 * y0 - DY23 * x0 > 0;
-			bool b10 = C2 + DX23 * y0 - DY23 * x1 > 0;
-			bool b01 = C2 + DX23 * y1 - DY23 * x0 > 0;
-			bool b11 = C2 + DX23 * y1 - DY23 * x1 > 0;
-			int b = (b00 << 0) | (b10 << 1) | (b01 << 2) | (b11 << 3);
-
-			bool c00 = C3 + DX31 * y0 - DY31 * x0 > 0;
-			bool c10 = C3 + DX31 * y0 - DY31 * x1 > 0;
-			bool c01 = C3 + DX31 * y1 - DY31 * x0 > 0;
-			bool c11 = C3 + DX31 * y1 - DY31 * x1 > 0;
-			int c = (c00 << 0) | (c10 << 1) | (c01 << 2) | (c11 << 3);
-
-			// Skip block when outside an edge
-			if(a == 0x0 || b == 0x0 || c == 0x0) continue;
+			// Skip block when outside an edge, or hidden
+			if( !(live & bit) ) continue;
+			if( hiz_row && face->near_w < MSR_HiZLoad(hiz_row[x >> MSR_HIZ_BLOCK_SHIFT]) ) continue;
+
+			// Corner of block
+			int x0 = (x - minx) << 4;
+			int y0 = (y - miny) << 4;
 
 			// Accept whole block when totally covered
-			if( a == 0xF && b == 0xF && c == 0xF )
+			if( accept & bit )
 			{
-				// Generate a fragment
-				MSR_Fragment *frag = MSR_FragmentBufferGetNext(frag_buffer);
-				frag->state = MSR_FRAGMENT_STATE_BLOCK;
-				frag->thread_id = thread_id;
-				frag->face_idx = face_idx;
-				frag->x = x;
-				frag->y = y;
+				// Generate a fragment, or add to the run of blocks before it
+				MSR_FragmentBufferAddBlock(frag_buffer, thread_id, face_idx, x, y);
 			}
 			else 
 			{
@@ -768,13 +1120,7 @@ void RasterizeTriangleSolid(Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffe
 					Uint32 mask = _mm_movemask_ps(*(__m128*)&_mm_and_si128(cx_mask_comp, _mm_set1_epi32(0xF0000000)));
 					if( mask )
 					{
-						MSR_Fragment *frag = MSR_FragmentBufferGetNext(frag_buffer);
-						frag->state = MSR_FRAGMENT_STATE_BLOCK_MASK;
-						frag->thread_id = thread_id;
-						frag->face_idx = face_idx;
-						frag->x = x;
-						frag->y = iy;
-						frag->mask = mask;
+						MSR_FragmentBufferAdd(frag_buffer, MSR_FRAGMENT_STATE_BLOCK_MASK, thread_id, face_idx, x, iy, mask);
 					}
 					
 					// Interpolate the edge functions and generate another set of 128-bit masks for all four pixels
@@ -792,13 +1138,7 @@ void RasterizeTriangleSolid(Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffe
 					mask = _mm_movemask_ps(*(__m128*)&_mm_and_si128(cx_mask_comp, _mm_set1_epi32(0xF0000000)));
 					if( mask )
 					{
-						MSR_Fragment *frag = MSR_FragmentBufferGetNext(frag_buffer);
-						frag->state = MSR_FRAGMENT_STATE_BLOCK_MASK;
-						frag->thread_id = thread_id;
-						frag->face_idx = face_idx;
-						frag->x = x + 4;
-						frag->y = iy;
-						frag->mask = mask;
+						MSR_FragmentBufferAdd(frag_buffer, MSR_FRAGMENT_STATE_BLOCK_MASK, thread_id, face_idx, x + 4, iy, mask);
 					}
 		
 					CY1 += FDX12;
@@ -810,20 +1150,108 @@ void RasterizeTriangleSolid(Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffe
 	}
 }
 
-void PrepareRasterizer()
+//
+// Emit the coverage of a small face's stamp that falls in the region, as masked quads or, for
+// the AVX-512 kernel, as masked 4x4 stamps. The blocks it may land in are the ones the
+// rasterizer would visit.
+//
+
+template <bool stamps>
+static void RasterizeStampT(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height)
 {
-	if( render_context.color_enabled )
+	const MSR_TransformedFace *face = &state->face_buffer[thread_id][face_idx];
+
+	int minx = ((max(face->minx,tile_x)			   + 0xF) >> 4) & ~7;
+	int maxx =  (min(face->maxx,tile_x+tile_width)  + 0xF) >> 4;
+	int miny = ((max(face->miny,tile_y)			   + 0xF) >> 4) & ~7;
+	int maxy =  (min(face->maxy,tile_y+tile_height) + 0xF) >> 4;
+
+	const MSR_AtomicU32 *hiz = state->context.depth_enabled ? state->target->hiz_blocks : NULL;
+
+	// Drop the quads outside the region, or hidden
+	Uint64 cover = face->stamp_mask;
+	for( int r=0; r<8; r++ )
+	{
+		int y = face->stamp_y + r;
+		for( int i=0; i<2; i++ )
+		{
+			Uint64 quad = (Uint64)0xF << (r * 8 + i * 4);
+			int x = face->stamp_x + i * 4;
+			if( !(cover & quad) ) continue;
+			if( y < miny || (y & ~7) >= maxy || x < minx || (x & ~7) >= maxx ||
+				(hiz && face->near_w < MSR_HiZLoad(hiz[(y >> MSR_HIZ_BLOCK_SHIFT) * state->target->hiz_pitch + (x >> MSR_HIZ_BLOCK_SHIFT)])) )
+				cover &= ~quad;
+		}
+	}
+
+	for( int r=0; r<8; r += stamps ? 4 : 1 )
+	{
+		for( int i=0; i<2; i++ )
+		{
+			Uint32 mask = (Uint32)(cover >> (r * 8 + i * 4)) & 0xF;
+			if( stamps ) {
+				for( int k=1; k<4; k++ )
+					mask |= ((Uint32)(cover >> ((r + k) * 8 + i * 4)) & 0xF) << (k * 4);
+			}
+			if( !mask ) continue;
+
+			// Start the stamp on its first row, the rows above may be in the tile before
+			int top = 0;
+			while( !(mask & 0xF) ) {
+				mask >>= 4;
+				top++;
+			}
+
+			MSR_FragmentBufferAdd(frag_buffer, stamps ? MSR_FRAGMENT_STATE_STAMP_MASK : MSR_FRAGMENT_STATE_BLOCK_MASK, thread_id, face_idx, face->stamp_x + i * 4, face->stamp_y + r + top, mask);
+		}
+	}
+}
+
+void RasterizeStamp(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height)
+{
+	RasterizeStampT<false>(state, thread_id, face_idx, frag_buffer, tile_x, tile_y, tile_width, tile_height);
+}
+
+void RasterizeStamp4x4(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height)
+{
+	RasterizeStampT<true>(state, thread_id, face_idx, frag_buffer, tile_x, tile_y, tile_width, tile_height);
+}
+
+void PrepareRasterizer(MSR_DrawState *state)
+{
+	if( visibility_buffer )
+	{
+		PrepareRasterizerVisibility(state);
+		return;
+	}
+
+	if( cpu_avx512 )
+	{
+		PrepareRasterizerAVX512(state);
+		return;
+	}
+
+	state->RasterizeTriangle = RasterizeTriangleSolid;
+	state->RasterizeStamp = RasterizeStamp;
+
+	if( cpu_avx2 )
+	{
+		PrepareRasterizerAVX2(state);
+		return;
+	}
+
+	if( state->context.color_enabled )
 	{
-		if( render_context.depth_enabled )
-			RenderFragments = RenderFragmentsGeneric<true, true>;
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderFragmentsGeneric<true, true>;
 		else
-			RenderFragments = RenderFragmentsGeneric<true, false>;
+			state->RenderFragments = RenderFragmentsGeneric<true, false>;
 	}
 	else
 	{
-		if( render_context.depth_enabled )
-			RenderFragments = RenderFragmentsGeneric<false, true>;
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderFragmentsGeneric<false, true>;
 		else
-			RenderFragments = RenderFragmentsGeneric<false, false>;
+			state->RenderFragments = RenderFragmentsGeneric<false, false>;
 	}
 }
\ No newline at end of file
@@ -23,6 +23,7 @@
 
 #include "MSR_Math.h"
 #include "MSR_Fragment.h"
+#include "MSR_Sync.h"
 
 #pragma comment(lib,"MSR_Math.lib")
 
@@ -35,10 +36,87 @@
 #define MSR_VERTEX_BUFFER_SIZE_CLIP		MSR_VERTEX_BUFFER_SIZE*5
 #define MSR_VERTEX_CACHE_SIZE			32
 
-#define MSR_BIN_TRIANGLE_QUEUE_SIZE		MSR_VERTEX_BUFFER_SIZE_CLIP
+// Tile bins are lists of fixed size chunks, which every thread takes from its own arena
+// for the batch slot. Arenas grow a block of chunks at a time and are emptied when the
+// slot takes a new batch, so they hold what the busiest batch so far needed.
+#define MSR_BIN_CHUNK_SIZE				64
+#define MSR_BIN_ARENA_BLOCK				256
+
+// Bin entries are face indices, with the top bit set if the face covers the whole tile
+#define MSR_BIN_ACCEPT					0x80000000
+
+// Triangles handed out per grab in the vertex stage. Capped at half of a thread's share of a
+// full batch, so that no thread can take so much work that it runs out of buffer space.
+#define MSR_VERTEX_CHUNK_SIZE			256
+#define MSR_VERTEX_MAX_CHUNKS			(MSR_VERTEX_BUFFER_SIZE/3)
+
+// Draws a deferred frame holds before it has to be drawn early. It also shares the chunk
+// table and the buffers of one batch slot.
+#define MSR_FRAME_MAX_DRAWS				256
 #define MSR_SCREEN_TILE_SIZE			64
 #define MSR_SCREEN_TILE_SIZE_SHIFT		6
 
+// Large triangles are binned against 4x4 tile super-tiles first, which are skipped or
+// accepted whole when they lie outside the triangle or inside it
+#define MSR_SUPER_TILE_SHIFT			2
+
+// Tile job cost estimates, in 8x8 blocks. A binned triangle costs its setup plus
+// about half of its bounding box overlap with the tile, a trivially accepted one
+// shades the whole tile.
+#define MSR_TILE_COST_SETUP				1
+#define MSR_TILE_COST_ACCEPT			((MSR_SCREEN_TILE_SIZE*MSR_SCREEN_TILE_SIZE) >> 6)
+
+// Tiles holding more than 1/MSR_TILE_SPLIT_SHARE of a thread's share of the batch are split
+// into 32x32 or 16x16 sub-tile jobs so that idle threads can help finish them. Below
+// MSR_TILE_SPLIT_MIN_COST the repeated triangle setup is not worth it. Sub-tile jobs
+// rasterize into a pool of MSR_TILE_SPLIT_BUFFERS fragment buffers per render target.
+#define MSR_TILE_SPLIT_SHARE			2
+#define MSR_TILE_SPLIT_MIN_COST			256
+#define MSR_TILE_SPLIT_BUFFERS			32
+
+// Binning state a thread writes for every face is kept on cache lines of its own
+#define MSR_CACHE_LINE_SIZE				64
+
+// Batches in flight. While the workers rasterize and shade one, the submitting thread can
+// already run the vertex stage of the next, so every render target keeps this many sets of
+// bins and the vertex and face buffers are doubled up. Must be a power of two.
+#define MSR_BATCH_SLOTS					2
+
+// Edge functions are set up in 64 bits, then rebased to the corner of each tile, region or
+// stamp they are stepped across, clamped to MSR_EDGE_CLAMP either way. Stepping up to
+// MSR_EDGE_REACH pixels from there stays in 32 bits and keeps the sign, as long as the edges
+// span no more than MSR_EDGE_CLAMP / (2 * 16 * 16 * MSR_EDGE_REACH) pixels. That bounds the
+// size of a target and its guard band.
+#define MSR_EDGE_CLAMP					(1 << 30)
+#define MSR_EDGE_REACH					(2 * MSR_SCREEN_TILE_SIZE)
+
+// Hierarchical Z keeps the farthest depth of every 8x8 block and every tile
+#define MSR_HIZ_BLOCK_SHIFT				3
+#define MSR_HIZ_TILE_BLOCKS				(MSR_SCREEN_TILE_SIZE >> MSR_HIZ_BLOCK_SHIFT)
+
+// Clears are put off in pieces of a tile as small as a split tile job, a bit for the colour and
+// one for the depth of every piece
+#define MSR_CLEAR_BLOCK_SHIFT			4
+#define MSR_CLEAR_BLOCK_SIZE			(1 << MSR_CLEAR_BLOCK_SHIFT)
+#define MSR_CLEAR_TILE_BLOCKS			(MSR_SCREEN_TILE_SIZE >> MSR_CLEAR_BLOCK_SHIFT)
+#define MSR_CLEAR_COLOR_BITS			0x0000FFFF
+#define MSR_CLEAR_DEPTH_BITS			0xFFFF0000
+#define MSR_CLEAR_DEPTH_SHIFT			16
+
+// Visibility buffer entries are the draw in the deferred frame, the thread and the face in its
+// face buffer. All ones is MSR_VISIBILITY_NONE, so face indices have to stay below 0xFFFF.
+#define MSR_VISIBILITY_MAX_DRAWS		256
+#define MSR_VISIBILITY_MAX_THREADS		256
+#define MSR_VISIBILITY_MAX_FACES		0xFFFF
+#define MSR_VISIBILITY_NONE				0xFFFFFFFF
+#define MSR_VISIBILITY_ID(draw, thread, face)	( ((draw) << 24) | ((thread) << 16) | (face) )
+#define MSR_VISIBILITY_DRAW(id)			( (id) >> 24 )
+#define MSR_VISIBILITY_THREAD(id)		( ((id) >> 16) & 0xFF )
+#define MSR_VISIBILITY_FACE(id)			( (id) & 0xFFFF )
+
+static_assert( MSR_FRAME_MAX_DRAWS <= MSR_VISIBILITY_MAX_DRAWS, "Deferred frame holds more draws than a visibility id has room for" );
+static_assert( MSR_VERTEX_BUFFER_SIZE_CLIP / 3 <= MSR_VISIBILITY_MAX_FACES, "A face buffer holds more faces than a visibility id has room for" );
+
 // S T R U C T S //////////////////////////////////////////////////////
 
 //
@@ -53,10 +131,14 @@ struct MSR_RenderContext {
 	bool depth_enabled;
 	bool color_enabled;
 
+	// Guard band in pixels, see MSR_SetGuardBand
+	Uint32 guard_band;
+
 	// Shader info
 	Uint32 num_varyings;
 	void (*VertexShader)(MSR_VShaderParameters *);
 	void (*FragmentShader)(MSR_FShaderParameters *);
+	void (*FragmentShader8)(MSR_FShaderParameters8 *);
 
 	MSR_ShaderGlobals globals;
 };
@@ -72,26 +154,40 @@ struct MSR_VertexCacheElement {
 };
 
 //
-// Face
+// Half-space functions of a face's edges in 28.4 fixed point, set up once for all the tiles it
+// is rasterized in. The constants are at the origin of the target, offset steps an edge to the
+// four pixels of a quad, and shifted up by three to four blocks in a row.
+//
+
+MSR_SSE_ALIGNED struct MSR_EdgeSetup {
+	__m128i offset[3];
+	Sint64 c[3];
+	int dx[3], dy[3];
+};
+
+//
+// Face, with what the rasterizer needs up front
 //
 
-struct MSR_TransformedFace {
+MSR_SSE_ALIGNED struct MSR_TransformedFace {
+	MSR_EdgeSetup edges;
+
+	// Cache the bounding box of this face
+	int minx, maxx, miny, maxy;
+
 	MSR_TransformedVertex *v[3];
 
 	// Cached start values for varyings
 	float v0x, v0y, v0w;
 	float v0v[MSR_MAX_VARYINGS];
 
-	// Cached fixed point coordinates
-	int fp1[2];
-	int fp2[2];
-	int fp3[2];
-
-	// Cached half edge constants
-	int c1, c2, c3;
+	// Largest inverse W anywhere in the face, with some margin, for the hierarchical Z tests
+	float near_w;
 
-	// Cache the bounding box of this face
-	int minx, maxx, miny, maxy;
+	// Coverage of small faces, worked out during setup: eight bits for each row of an 8x8
+	// stamp at stamp_x, stamp_y, bit 0 at the left. Zero for faces that take the rasterizer.
+	Uint64 stamp_mask;
+	int stamp_x, stamp_y;
 
 	// Inverse W coordinate
 	MSR_Vec2 dw;
@@ -100,6 +196,60 @@ struct MSR_TransformedFace {
 	MSR_Vec2 dv[MSR_MAX_VARYINGS];
 };
 
+//
+// A count one thread keeps updating, alone on its cache line
+//
+
+struct MSR_ThreadCount {
+	Uint32 count;
+	Uint8 pad[MSR_CACHE_LINE_SIZE - sizeof(Uint32)];
+};
+
+//
+// Bin storage
+//
+
+struct MSR_BinChunk {
+	Uint32 faces[MSR_BIN_CHUNK_SIZE];
+	MSR_BinChunk *next;
+};
+
+struct MSR_BinArenaBlock {
+	MSR_BinChunk chunks[MSR_BIN_ARENA_BLOCK];
+	MSR_BinArenaBlock *next;
+};
+
+struct MSR_BinArena {
+
+	// Blocks allocated so far, the one being handed out and how many chunks of it are taken
+	MSR_BinArenaBlock *first;
+	MSR_BinArenaBlock *current;
+	Uint32 used;
+};
+
+//
+// One thread's bin for a tile. The size is published with a release store so that the bin
+// can be read while its owner is still appending to it.
+//
+
+struct MSR_TileBin {
+	MSR_BinChunk *head;
+	MSR_BinChunk *tail;
+	MSR_AtomicU32 size;
+
+	// Estimated work in the bin
+	Uint32 cost;
+};
+
+//
+// Position in a bin. chunk holds the entry before pos, or is NULL at the start.
+//
+
+struct MSR_BinCursor {
+	MSR_BinChunk *chunk;
+	Uint32 pos;
+};
+
 // 
 // Tile
 //
@@ -112,16 +262,69 @@ struct MSR_Tile {
 	// Corner of the tile
 	Uint16 x, y;
 
-	// Bin queues of elements
-	Uint32 **index_buffer;
-	Uint32 *index_buffer_size;
-	volatile Uint32 dirty;
+	// Set once the tile has anything binned. The bins themselves are kept by thread, see
+	// MSR_TileBins.
+	MSR_AtomicU32 dirty;
+
+	// Estimated work in all bins, used to order the job queue
+	Uint32 job_cost;
 
-	// Bin queue of trivially accepted tiles
-	Uint8 **frag_tiles;
+	// Vertex chunks already rasterized during the vertex stage, how far into each bin that
+	// got, and who is doing it
+	MSR_AtomicU32 raster_progress;
+	MSR_BinCursor *raster_cursor;
+	MSR_AtomicU32 raster_lock;
 
 	// Fragment buffer for rasterization
 	MSR_FragmentBuffer frag_buffer;
+
+	// Jobs on this tile that still have to be shaded. The next batch waits for it to drop to
+	// zero before touching the tile's pixels.
+	MSR_AtomicU32 shade_pending;
+};
+
+//
+// Tile job, either a whole tile or a piece of a split one
+//
+
+struct MSR_TileJob {
+	Uint32 tile_idx;
+	Uint32 cost;
+
+	// Region of the tile covered by this job
+	Uint16 x, y;
+	Uint16 width, height;
+
+	// Fragment buffer for rasterization
+	MSR_FragmentBuffer *frag_buffer;
+};
+
+//
+// Tiles and job queue of a render target for one batch slot
+//
+
+struct MSR_TileBins {
+
+	MSR_Tile *tiles;
+
+	// Every thread's bins for all tiles, indexed [thread][tile]. Each thread's array starts on
+	// a cache line and fills whole lines, so binning never writes to a line another thread
+	// writes. The raster stage reads across them.
+	MSR_TileBin **thread_bins;
+
+	// Tiles in the order they were first binned, and how far raster and shading are through the jobs
+	Uint32 *job_queue;
+	MSR_AtomicU32 job_queue_start_rt;
+	MSR_AtomicU32 job_queue_start_ft;
+	MSR_AtomicU32 job_queue_end;
+
+	// Jobs built from the queue once binning is done, and whether each is still being rasterized
+	MSR_TileJob *jobs;
+	MSR_AtomicU32 *job_ready;
+	Uint32 num_jobs;
+
+	// Fragment buffers for sub-tile jobs
+	MSR_FragmentBuffer split_buffers[MSR_TILE_SPLIT_BUFFERS];
 };
 
 struct MSR_RenderTarget {
@@ -132,9 +335,71 @@ struct MSR_RenderTarget {
 	Uint32 num_tiles_x;
 	Uint32 num_tiles_y;
 	Uint32 num_tiles;
-	MSR_Tile *tiles;
 
-	Uint32 *job_queue;
+	// Colour and depth as they are shaded, a whole tile after another (see MSR_TiledOffset), so a
+	// tile job keeps to its own 16 KB of each. The colour is copied out to back_buffer when the
+	// scene ends if anything was written to it, the depth to z_buffer only when it is asked for.
+	// depth_tiles is NULL without a Z-buffer.
+	Uint32 *color_tiles;
+	float *depth_tiles;
+	bool color_dirty;
+	bool depth_dirty;
+
+	// Pieces of every tile that were cleared and not written since, MSR_CLEAR_COLOR_BITS and
+	// MSR_CLEAR_DEPTH_BITS. The first job to shade a piece fills it, or the resolve does.
+	MSR_AtomicU32 *tile_clear;
+	Uint32 clear_color;
+
+	MSR_TileBins bins[MSR_BATCH_SLOTS];
+
+	// Widest guard band the rasterizer can take at this size
+	Uint32 guard_band_max;
+
+	// Hierarchical Z, NULL without a Z-buffer. The farthest depth (smallest inverse W) of every
+	// 8x8 block, hiz_pitch to a row, and of every tile, as float bits. Depth only ever grows
+	// until the next clear, so these may lag behind the Z-buffer but are never beyond it, and a
+	// face whose near_w is less is hidden there. Blocks are updated when they are shaded whole,
+	// tiles when the last job on them is through.
+	MSR_AtomicU32 *hiz_blocks;
+	MSR_AtomicU32 *hiz_tiles;
+	Uint32 hiz_pitch;
+
+	// Face seen at every pixel, vis_pitch to a row and padded out to whole tiles. NULL unless
+	// MSR_INIT_VISIBILITY_BUFFER is set. Tile jobs leave their pixels at MSR_VISIBILITY_NONE.
+	Uint32 *vis_ids;
+	Uint32 vis_pitch;
+};
+
+//
+// Everything the pipeline reads for a batch. The render context is copied when the batch is
+// submitted, so it keeps drawing with the old state while the next batch is being set up.
+//
+
+struct MSR_DrawState {
+
+	MSR_RenderContext context;
+
+	// Where the batch goes, and the bins of the batch before it if it went to the same place
+	MSR_RenderTarget *target;
+	MSR_TileBins *bins;
+	MSR_TileBins *prev_bins;
+
+	// Vertex and face buffers and bin arenas of the batch slot
+	MSR_TransformedVertex **vertex_buffer;
+	Uint32 *vertex_buffer_size;
+	MSR_TransformedFace **face_buffer;
+	MSR_BinArena *bin_arenas;
+
+	// Index of the draw in a deferred frame, which the visibility buffer records
+	Uint32 draw_idx;
+
+	// Guard band as a multiple of the clip space extent in x and y
+	float guard_x, guard_y;
+
+	// Triangle rasterizing and fragment rendering functions
+	void (*RasterizeTriangle)(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height);
+	void (*RasterizeStamp)(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height);
+	void (*RenderFragments)(MSR_DrawState *state, MSR_FragmentBuffer *fb);
 };
 
 // G L O B A L S ///////////////////////////////////////////////////////
@@ -147,14 +412,87 @@ MSRAPI Uint32 num_render_targets;
 // Render context
 MSRAPI MSR_RenderContext render_context;
 
-// Fragment rendering function
-MSRAPI void (*RenderFragments)(MSR_FragmentBuffer *fb);
+// Blocks allocated by all bin arenas
+MSRAPI MSR_AtomicU32 bin_arena_blocks;
+
+// Use the AVX2 fragment kernels, or the AVX-512 rasterizer and fragment kernels
+MSRAPI bool cpu_avx2;
+MSRAPI bool cpu_avx512;
+
+// Rasterize deferred frames into the visibility buffer and shade each pixel once
+MSRAPI bool visibility_buffer;
 
 // F U N C T I O N S //////////////////////////////////////////////////
 
 MSRAPI void MSR_DestroyRenderTarget( Uint32 id );
-MSRAPI void PostProcessVertex(MSR_TransformedVertex *v_trans);
-MSRAPI void RasterizeTriangleSolid(Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height);
-MSRAPI void PrepareRasterizer();
+MSRAPI void PostProcessVertex(MSR_DrawState *state, MSR_TransformedVertex *v_trans);
+MSRAPI void RasterizeTriangleSolid(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height);
+MSRAPI void RasterizeStamp(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height);
+MSRAPI void RasterizeStamp4x4(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height);
+MSRAPI void PrepareRasterizer(MSR_DrawState *state);
+MSRAPI void PrepareRasterizerAVX2(MSR_DrawState *state);
+MSRAPI void PrepareRasterizerAVX512(MSR_DrawState *state);
+MSRAPI void PrepareRasterizerVisibility(MSR_DrawState *state);
+MSRAPI void ResolveVisibility(MSR_DrawState *draws, const MSR_TileJob &job);
+MSRAPI void PrepareTileJob(MSR_RenderTarget *target, const MSR_TileJob &job);
+
+//
+// Edge function of a face at a point in 28.4 fixed point, to be stepped from there in 32 bits
+//
+
+static inline int MSR_EdgeAt( Sint64 c, int dx, int dy, int x, int y )
+{
+	Sint64 e = c + (Sint64)dx * y - (Sint64)dy * x;
+	return (int)( e > MSR_EDGE_CLAMP ? MSR_EDGE_CLAMP : e < -MSR_EDGE_CLAMP ? -MSR_EDGE_CLAMP : e );
+}
+
+//
+// Where a pixel is in the tiled colour and depth buffers. Rows are MSR_SCREEN_TILE_SIZE apart,
+// for anything that stays within the tile.
+//
+
+static inline Uint32 MSR_TiledOffset( const MSR_RenderTarget *target, Uint32 x, Uint32 y )
+{
+	Uint32 tile = (y >> MSR_SCREEN_TILE_SIZE_SHIFT) * target->num_tiles_x + (x >> MSR_SCREEN_TILE_SIZE_SHIFT);
+	return (tile << (2 * MSR_SCREEN_TILE_SIZE_SHIFT)) +
+		   ((y & (MSR_SCREEN_TILE_SIZE - 1)) << MSR_SCREEN_TILE_SIZE_SHIFT) + (x & (MSR_SCREEN_TILE_SIZE - 1));
+}
+
+//
+// Hierarchical Z values are read while other threads update them, the races only make a test
+// less strict. The relaxed accesses are spelled out rather than left to std::atomic::load/store,
+// which aren't force-inlined and would otherwise be emitted in the AVX units and shared with the
+// SSE path. On x86 MSVC compiles a volatile access to the same plain move as a relaxed atomic one.
+//
+
+static inline float MSR_HiZLoad( const MSR_AtomicU32 &hiz )
+{
+	union { Uint32 bits; float depth; } v;
+#if defined(_MSC_VER)
+	v.bits = *(const volatile Uint32 *)&hiz;
+#else
+	v.bits = __atomic_load_n( (const Uint32 *)&hiz, __ATOMIC_RELAXED );
+#endif
+	return v.depth;
+}
+
+static inline void MSR_HiZStore( MSR_AtomicU32 &hiz, float depth )
+{
+	union { Uint32 bits; float depth; } v;
+	v.depth = depth;
+#if defined(_MSC_VER)
+	*(volatile Uint32 *)&hiz = v.bits;
+#else
+	__atomic_store_n( (Uint32 *)&hiz, v.bits, __ATOMIC_RELAXED );
+#endif
+}
+
+// Record the depth of a block that was just shaded whole, the smallest of the four lanes
+static inline void MSR_HiZStoreBlock( MSR_RenderTarget *target, Uint32 x, Uint32 y, __m128 depth )
+{
+	depth = _mm_min_ps( depth, _mm_movehl_ps(depth, depth) );
+	depth = _mm_min_ss( depth, _mm_shuffle_ps(depth, depth, 1) );
+	MSR_HiZStore( target->hiz_blocks[ (y >> MSR_HIZ_BLOCK_SHIFT) * target->hiz_pitch + (x >> MSR_HIZ_BLOCK_SHIFT) ], _mm_cvtss_f32(depth) );
+}
 
 #endif
\ No newline at end of file
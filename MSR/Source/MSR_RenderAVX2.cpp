@@ -0,0 +1,274 @@
+///////////////////////////////////////////////////////////////////////
+//
+// Multithreaded Software Rasterizer
+// Copyright 2010 - 2012 :: Zach Bethel 
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License v2
+// as published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include "MSR_Render.h"
+#include <immintrin.h>
+#include <float.h>
+
+// /arch:AVX2 as a per-file option needs VS2013 Update 2
+#if defined(_MSC_FULL_VER) && _MSC_FULL_VER < 180030501
+#error MSR_RenderAVX2.cpp needs Visual C++ 2013 Update 2 or later
+#endif
+
+//
+// AVX2 fragment kernels. They shade 8x1 spans: the two quads of a block row in one go, or a
+// single masked quad with the upper half switched off. Interpolation starts out exactly as in
+// the SSE kernels, so both write the same pixels. If the shader has no 8-wide version, the
+// 4-wide one is run on each half of the span.
+//
+// This file is built with AVX2 code generation. Nothing in it may run unless MSR_Init found
+// AVX2 on the CPU. It must not instantiate anything the SSE units could also emit: an inline
+// function or a non-trivial constructor compiled here can be the copy the linker keeps.
+//
+
+//
+// Shade a span and write out whatever passes the coverage mask and the depth test. With
+// half = true only the lower four pixels are touched. Returns the depth left in the span.
+//
+
+template <bool useColorBuffer, bool useZBuffer, bool half>
+static __forceinline __m256 ShadeSpan( MSR_DrawState *state, MSR_FShaderParameters8 &params8, MSR_FShaderParameters &params4, 
+									 __m256 W, const __m256 *V, __m256 cover, Uint32 *colorBuffer, float *depthBuffer )
+{
+	__m256 dq = W, m = cover;
+	if( useZBuffer )
+	{
+		dq = half ? _mm256_castps128_ps256( _mm_load_ps(depthBuffer) ) : _mm256_loadu_ps(depthBuffer);
+		m = _mm256_and_ps( m, _mm256_cmp_ps(W, dq, _CMP_GE_OS) );
+
+		// Early reject the span if we can
+		if( !_mm256_movemask_ps(m) )
+			return dq;
+	}
+
+	if( useColorBuffer )
+	{
+		__m256i oq = half ? _mm256_castsi128_si256( _mm_load_si128((__m128i*)colorBuffer) ) : _mm256_loadu_si256((__m256i*)colorBuffer);
+		__m256 w = _mm256_rcp_ps(W);
+		__m256 r, g, b;
+
+		if( state->context.FragmentShader8 )
+		{
+			for( Uint32 i=0; i<state->context.num_varyings; i++ )
+				params8.varyings[i] = _mm256_mul_ps(w, V[i]);
+
+			state->context.FragmentShader8(&params8);
+			r = params8.output.r;
+			g = params8.output.g;
+			b = params8.output.b;
+		}
+		else
+		{
+			for( Uint32 i=0; i<state->context.num_varyings; i++ )
+				params4.varyings[i].f = _mm256_castps256_ps128( _mm256_mul_ps(w, V[i]) );
+
+			state->context.FragmentShader(&params4);
+			r = _mm256_castps128_ps256( params4.output.r.f );
+			g = _mm256_castps128_ps256( params4.output.g.f );
+			b = _mm256_castps128_ps256( params4.output.b.f );
+
+			if( !half )
+			{
+				for( Uint32 i=0; i<state->context.num_varyings; i++ )
+					params4.varyings[i].f = _mm256_extractf128_ps( _mm256_mul_ps(w, V[i]), 1 );
+
+				state->context.FragmentShader(&params4);
+				r = _mm256_insertf128_ps( r, params4.output.r.f, 1 );
+				g = _mm256_insertf128_ps( g, params4.output.g.f, 1 );
+				b = _mm256_insertf128_ps( b, params4.output.b.f, 1 );
+			}
+		}
+
+		// Convert back to 255 range, clamp and pack
+		__m256 fMax = _mm256_set1_ps( 255.0f );
+		__m256i iR = _mm256_cvtps_epi32( _mm256_min_ps( _mm256_mul_ps(r, fMax), fMax ) );
+		__m256i iG = _mm256_cvtps_epi32( _mm256_min_ps( _mm256_mul_ps(g, fMax), fMax ) );
+		__m256i iB = _mm256_cvtps_epi32( _mm256_min_ps( _mm256_mul_ps(b, fMax), fMax ) );
+		__m256i nq = _mm256_or_si256( _mm256_or_si256( _mm256_slli_epi32(iR, 16), _mm256_slli_epi32(iG, 8) ), iB );
+
+		// Store the new color into the frame buffer
+		nq = _mm256_blendv_epi8( oq, nq, _mm256_castps_si256(m) );
+		if( half )
+			_mm_store_si128( (__m128i*)colorBuffer, _mm256_castsi256_si128(nq) );
+		else
+			_mm256_storeu_si256( (__m256i*)colorBuffer, nq );
+	}
+
+	if( useZBuffer )
+	{
+		dq = _mm256_blendv_ps( dq, W, m );
+		if( half )
+			_mm_store_ps( depthBuffer, _mm256_castps256_ps128(dq) );
+		else
+			_mm256_storeu_ps( depthBuffer, dq );
+	}
+
+	return dq;
+}
+
+//
+// Shade a fully covered 8x8 block
+//
+
+template <bool useColorBuffer, bool useZBuffer>
+static __forceinline void ShadeBlock( MSR_DrawState *state, MSR_FShaderParameters8 &params8, MSR_FShaderParameters &params4,
+									  MSR_TransformedFace *face, Uint32 bx, Uint32 by, Uint32 cb_pitch, Uint32 db_pitch )
+{
+	__m128 C0 = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+	__m128 C1 = _mm_set_ps1( 4.0f );
+	__m256 cover = _mm256_castsi256_ps( _mm256_set1_epi32(-1) );
+
+	Uint32 *colorBuffer = state->target->color_tiles + MSR_TiledOffset(state->target, bx, by);
+	float *depthBuffer = NULL;
+	if( useZBuffer ) depthBuffer = state->target->depth_tiles + MSR_TiledOffset(state->target, bx, by);
+
+	// Set up the two quads of the first row the same way as the SSE kernel, then pair them up
+	float dxstart = (float)bx - face->v0x;
+	float dystart = (float)by - face->v0y;
+
+	__m128 dx = _mm_set1_ps(face->dw.x);
+	__m128 base = _mm_set1_ps(face->v0w + face->dw.x * dxstart + face->dw.y * dystart);
+	__m128 W0 = _mm_add_ps( base, _mm_mul_ps( dx, C0 ) );
+	__m128 W1 = _mm_add_ps( W0, _mm_mul_ps( dx, C1 ) );
+	__m256 W = _mm256_insertf128_ps( _mm256_castps128_ps256(W0), W1, 1 );
+	__m256 WDY = _mm256_set1_ps(face->dw.y);
+
+	__m256 V[MSR_MAX_VARYINGS], VDY[MSR_MAX_VARYINGS];
+	if( useColorBuffer )
+	{
+		for( Uint32 i=0; i<state->context.num_varyings; i++ )
+		{
+			dx = _mm_set1_ps(face->dv[i].x);
+			base = _mm_set1_ps(face->v0v[i] + face->dv[i].x * dxstart + face->dv[i].y * dystart);
+			__m128 V0 = _mm_add_ps( base, _mm_mul_ps( dx, C0 ) );
+			__m128 V1 = _mm_add_ps( V0, _mm_mul_ps( dx, C1 ) );
+			V[i] = _mm256_insertf128_ps( _mm256_castps128_ps256(V0), V1, 1 );
+			VDY[i] = _mm256_set1_ps(face->dv[i].y);
+		}
+	}
+
+	// Farthest depth left in the block
+	__m256 zmin = _mm256_set1_ps(FLT_MAX);
+
+	for( Uint32 y=0; y<8; y++ )
+	{
+		__m256 dq = ShadeSpan<useColorBuffer, useZBuffer, false>( state, params8, params4, W, V, cover, colorBuffer, depthBuffer );
+		if( useZBuffer ) zmin = _mm256_min_ps( zmin, dq );
+
+		W = _mm256_add_ps( W, WDY );
+		if( useColorBuffer ) 
+		{
+			for( Uint32 i=0; i<state->context.num_varyings; i++ )
+				V[i] = _mm256_add_ps( V[i], VDY[i] );
+			colorBuffer += cb_pitch;
+		}
+		if( useZBuffer ) depthBuffer += db_pitch;
+	}
+
+	if( useZBuffer ) MSR_HiZStoreBlock( state->target, bx, by, _mm_min_ps( _mm256_castps256_ps128(zmin), _mm256_extractf128_ps(zmin, 1) ) );
+}
+
+template <bool useColorBuffer, bool useZBuffer>
+void RenderFragmentsAVX2(MSR_DrawState *state, MSR_FragmentBuffer *fb) 
+{
+	MSR_FShaderParameters8 params8;
+	MSR_SSE_ALIGNED MSR_FShaderParameters params4;
+	params8.globals = &state->context.globals;
+	params4.globals = &state->context.globals;
+
+	__m128 C0 = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+	__m256i mask_mask = _mm256_set_epi32(0, 0, 0, 0, 8, 4, 2, 1);
+
+	// Fragments never leave their tile, so rows are a tile apart
+	Uint32 cb_pitch = MSR_SCREEN_TILE_SIZE;
+	Uint32 db_pitch = MSR_SCREEN_TILE_SIZE;
+
+	for( int elem=0; elem<fb->elements; elem++ )
+	{
+		// Get the next fragment
+		MSR_Fragment *frag = MSR_FragmentBufferGet(fb, elem);
+		MSR_TransformedFace *face = &state->face_buffer[frag->thread_id][frag->face_idx];
+		Uint32 fx = fb->x + frag->x;
+		Uint32 fy = fb->y + frag->y;
+		
+		if( frag->state == MSR_FRAGMENT_STATE_BLOCK_MASK )
+		{
+			Uint32 *colorBuffer = state->target->color_tiles + MSR_TiledOffset(state->target, fx, fy);
+			float *depthBuffer = NULL;
+			if( useZBuffer ) depthBuffer = state->target->depth_tiles + MSR_TiledOffset(state->target, fx, fy);
+
+			// Lower half only
+			__m256i cover = _mm256_and_si256( _mm256_set1_epi32(frag->mask), mask_mask );
+			cover = _mm256_cmpgt_epi32( cover, _mm256_setzero_si256() );
+
+			float dxstart = (float)fx - face->v0x;
+			float dystart = (float)fy - face->v0y;
+
+			__m128 dx = _mm_set1_ps(face->dw.x);
+			__m128 base = _mm_set1_ps(face->v0w + face->dw.x * dxstart + face->dw.y * dystart);
+			__m256 W = _mm256_castps128_ps256( _mm_add_ps( base, _mm_mul_ps( dx, C0 ) ) );
+
+			__m256 V[MSR_MAX_VARYINGS];
+			if( useColorBuffer )
+			{
+				for( Uint32 i=0; i<state->context.num_varyings; i++ )
+				{
+					dx = _mm_mul_ps( _mm_set1_ps(face->dv[i].x), C0 );
+					base = _mm_set1_ps(face->v0v[i] + face->dv[i].x * dxstart + face->dv[i].y * dystart);
+					V[i] = _mm256_castps128_ps256( _mm_add_ps( base, dx ) );
+				}
+			}
+
+			ShadeSpan<useColorBuffer, useZBuffer, true>( state, params8, params4, W, V, _mm256_castsi256_ps(cover), colorBuffer, depthBuffer );
+		}
+		else if( frag->state == MSR_FRAGMENT_STATE_BLOCK )
+		{
+			// A run of blocks to the right
+			for( Uint32 bx=fx; bx <= fx + 8 * frag->mask; bx += 8 )
+				ShadeBlock<useColorBuffer, useZBuffer>( state, params8, params4, face, bx, fy, cb_pitch, db_pitch );
+		}
+		else
+		{
+			for( Uint32 by=fy; by < fy + MSR_SCREEN_TILE_SIZE; by += 8 )
+				for( Uint32 bx=fx; bx < fx + MSR_SCREEN_TILE_SIZE; bx += 8 )
+					ShadeBlock<useColorBuffer, useZBuffer>( state, params8, params4, face, bx, by, cb_pitch, db_pitch );
+		}
+	}
+
+	MSR_FragmentBufferClear(fb);
+}
+
+void PrepareRasterizerAVX2(MSR_DrawState *state)
+{
+	if( state->context.color_enabled )
+	{
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderFragmentsAVX2<true, true>;
+		else
+			state->RenderFragments = RenderFragmentsAVX2<true, false>;
+	}
+	else
+	{
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderFragmentsAVX2<false, true>;
+		else
+			state->RenderFragments = RenderFragmentsAVX2<false, false>;
+	}
+}
\ No newline at end of file
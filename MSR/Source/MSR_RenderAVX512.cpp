@@ -0,0 +1,503 @@
+///////////////////////////////////////////////////////////////////////
+//
+// Multithreaded Software Rasterizer
+// Copyright 2010 - 2012 :: Zach Bethel 
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License v2
+// as published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include "MSR_Render.h"
+#include <immintrin.h>
+#include <float.h>
+
+// /arch:AVX512 needs VS2017 15.3
+#if defined(_MSC_VER) && _MSC_VER < 1911
+#error MSR_RenderAVX512.cpp needs Visual C++ 2017 15.3 or later
+#endif
+
+//
+// AVX-512 rasterizer and fragment kernels. Partially covered 8x8 blocks are split into 4x4
+// stamps, and each stamp is one fragment with a 16-bit coverage mask. The mask goes straight
+// into an opmask register, so pixels are written with masked stores and never blended. Fully
+// covered blocks are shaded two rows at a time.
+//
+// W and the varyings are interpolated the same way as in the SSE kernels, and the 12-bit
+// reciprocal is kept instead of rcp14, so all three paths write the same pixels.
+//
+// This file is built with AVX-512 code generation. Nothing in it may run unless MSR_Init found
+// AVX-512 F, DQ, BW and VL on the CPU. As in the AVX2 unit, nothing here may instantiate an
+// inline function or constructor that the SSE units could emit as well.
+//
+
+//
+// Test the corners of eight blocks against one edge. any is set for the blocks with a corner
+// inside the edge, all for the blocks entirely inside it.
+//
+
+static __forceinline void ClassifyBlocks( __m256i e, __m256i cornerDY, __m256i cornerDX, __mmask8 &any, __mmask8 &all )
+{
+	__mmask8 a00 = _mm256_cmpgt_epi32_mask( e, _mm256_setzero_si256() );
+	__mmask8 a10 = _mm256_cmpgt_epi32_mask( _mm256_sub_epi32(e, cornerDY), _mm256_setzero_si256() );
+	e = _mm256_add_epi32( e, cornerDX );
+	__mmask8 a01 = _mm256_cmpgt_epi32_mask( e, _mm256_setzero_si256() );
+	__mmask8 a11 = _mm256_cmpgt_epi32_mask( _mm256_sub_epi32(e, cornerDY), _mm256_setzero_si256() );
+
+	any = a00 | a10 | a01 | a11;
+	all = a00 & a10 & a01 & a11;
+}
+
+//
+// Offsets of eight blocks in a row from the first, out of the offsets of four pixels in a quad
+//
+
+static __forceinline __m256i BlockOffsets( __m128i offset, int half )
+{
+	__m128i lo = _mm_slli_epi32( offset, 3 );
+	return _mm256_inserti128_si256( _mm256_castsi128_si256(lo), _mm_add_epi32(lo, _mm_set1_epi32(half)), 1 );
+}
+
+void RasterizeTriangleAVX512(MSR_DrawState *state, Uint32 thread_id, Uint32 face_idx, MSR_FragmentBuffer *frag_buffer, int tile_x, int tile_y, int tile_width, int tile_height) 
+{
+	MSR_TransformedFace *face = &state->face_buffer[thread_id][face_idx];
+
+	// Deltas
+	const MSR_EdgeSetup &edges = face->edges;
+	const int DX12 = edges.dx[0];
+	const int DX23 = edges.dx[1];
+	const int DX31 = edges.dx[2];
+	const int DY12 = edges.dy[0];
+	const int DY23 = edges.dy[1];
+	const int DY31 = edges.dy[2];
+
+	// Fixed-point deltas
+	const int FDX12 = DX12 << 4;
+	const int FDX23 = DX23 << 4;
+	const int FDX31 = DX31 << 4;
+	const int FDY12 = DY12 << 4;
+	const int FDY23 = DY23 << 4;
+	const int FDY31 = DY31 << 4;
+
+	// Edge function offsets of the 16 pixels of a stamp from its top left corner
+	__m512i lane = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m512i row = _mm512_srli_epi32(lane, 2);
+	__m512i iOffset12 = _mm512_sub_epi32( _mm512_mullo_epi32(row, _mm512_set1_epi32(FDX12)), _mm512_broadcast_i32x4(edges.offset[0]) );
+	__m512i iOffset23 = _mm512_sub_epi32( _mm512_mullo_epi32(row, _mm512_set1_epi32(FDX23)), _mm512_broadcast_i32x4(edges.offset[1]) );
+	__m512i iOffset31 = _mm512_sub_epi32( _mm512_mullo_epi32(row, _mm512_set1_epi32(FDX31)), _mm512_broadcast_i32x4(edges.offset[2]) );
+
+	// Steps from one stamp to the next
+	__m512i iFDX12 = _mm512_set1_epi32(FDX12 << 2);
+	__m512i iFDX23 = _mm512_set1_epi32(FDX23 << 2);
+	__m512i iFDX31 = _mm512_set1_epi32(FDX31 << 2);
+	__m512i iFDY12 = _mm512_set1_epi32(FDY12 << 2);
+	__m512i iFDY23 = _mm512_set1_epi32(FDY23 << 2);
+	__m512i iFDY31 = _mm512_set1_epi32(FDY31 << 2);
+
+	// Bounding rectangle
+	int minx = (max(face->minx,tile_x)			   + 0xF) >> 4;
+	int maxx = (min(face->maxx,tile_x+tile_width)  + 0xF) >> 4;
+	int miny = (max(face->miny,tile_y)			   + 0xF) >> 4;
+	int maxy = (min(face->maxy,tile_y+tile_height) + 0xF) >> 4;
+
+	// Block size, standard 8x8 (must be power of two)
+	const int q = 8;
+
+	// Start in corner of 8x8 block
+	minx &= ~(q - 1);
+	miny &= ~(q - 1);
+
+	// Half edge constants at that corner, everything is stepped from there
+	const int C1 = MSR_EdgeAt(edges.c[0], DX12, DY12, minx << 4, miny << 4);
+	const int C2 = MSR_EdgeAt(edges.c[1], DX23, DY23, minx << 4, miny << 4);
+	const int C3 = MSR_EdgeAt(edges.c[2], DX31, DY31, minx << 4, miny << 4);
+
+	// Blocks are classified eight at a time, which is a whole row of a tile. Offsets of the blocks
+	// in a group, of the far corners of a block, and the steps to the next group and to the next
+	// row of blocks.
+	__m256i iBlockDY12 = BlockOffsets( edges.offset[0], FDY12 * q * 4 );
+	__m256i iBlockDY23 = BlockOffsets( edges.offset[1], FDY23 * q * 4 );
+	__m256i iBlockDY31 = BlockOffsets( edges.offset[2], FDY31 * q * 4 );
+	__m256i iCornerDY12 = _mm256_set1_epi32(FDY12 * (q - 1));
+	__m256i iCornerDY23 = _mm256_set1_epi32(FDY23 * (q - 1));
+	__m256i iCornerDY31 = _mm256_set1_epi32(FDY31 * (q - 1));
+	__m256i iCornerDX12 = _mm256_set1_epi32(FDX12 * (q - 1));
+	__m256i iCornerDX23 = _mm256_set1_epi32(FDX23 * (q - 1));
+	__m256i iCornerDX31 = _mm256_set1_epi32(FDX31 * (q - 1));
+	__m256i iGroupDY12 = _mm256_set1_epi32(FDY12 * q * 8);
+	__m256i iGroupDY23 = _mm256_set1_epi32(FDY23 * q * 8);
+	__m256i iGroupDY31 = _mm256_set1_epi32(FDY31 * q * 8);
+	__m256i iRowDX12 = _mm256_set1_epi32(FDX12 * q);
+	__m256i iRowDX23 = _mm256_set1_epi32(FDX23 * q);
+	__m256i iRowDX31 = _mm256_set1_epi32(FDX31 * q);
+
+	// Edge functions at the top left corners of the first eight blocks
+	__m256i iBY1 = _mm256_sub_epi32( _mm256_set1_epi32(C1), iBlockDY12 );
+	__m256i iBY2 = _mm256_sub_epi32( _mm256_set1_epi32(C2), iBlockDY23 );
+	__m256i iBY3 = _mm256_sub_epi32( _mm256_set1_epi32(C3), iBlockDY31 );
+
+	// Blocks already covered by something nearer are skipped
+	const MSR_AtomicU32 *hiz = state->context.depth_enabled ? state->target->hiz_blocks : NULL;
+
+	// Loop through blocks
+	for(int y = miny; y < maxy; y += q)
+	{
+		const MSR_AtomicU32 *hiz_row = hiz ? hiz + (y >> MSR_HIZ_BLOCK_SHIFT) * state->target->hiz_pitch : NULL;
+
+		// Classify the row of blocks, one bit per block
+		Uint32 live = 0, accept = 0;
+		__m256i iBX1 = iBY1;
+		__m256i iBX2 = iBY2;
+		__m256i iBX3 = iBY3;
+
+		for(int x = minx, bit = 0; x < maxx; x += q * 8, bit += 8)
+		{
+			__mmask8 any1, any2, any3, all1, all2, all3;
+			ClassifyBlocks( iBX1, iCornerDY12, iCornerDX12, any1, all1 );
+			ClassifyBlocks( iBX2, iCornerDY23, iCornerDX23, any2, all2 );
+			ClassifyBlocks( iBX3, iCornerDY31, iCornerDX31, any3, all3 );
+
+			live |= (Uint32)( any1 & any2 & any3 ) << bit;
+			accept |= (Uint32)( all1 & all2 & all3 ) << bit;
+
+			iBX1 = _mm256_sub_epi32( iBX1, iGroupDY12 );
+			iBX2 = _mm256_sub_epi32( iBX2, iGroupDY23 );
+			iBX3 = _mm256_sub_epi32( iBX3, iGroupDY31 );
+		}
+
+		iBY1 = _mm256_add_epi32( iBY1, iRowDX12 );
+		iBY2 = _mm256_add_epi32( iBY2, iRowDX23 );
+		iBY3 = _mm256_add_epi32( iBY3, iRowDX31 );
+
+		for(int x = minx, bit = 1; x < maxx; x += q, bit <<= 1)
+		{
+			// Skip block when outside an edge, or hidden
+			if( !(live & bit) ) continue;
+			if( hiz_row && face->near_w < MSR_HiZLoad(hiz_row[x >> MSR_HIZ_BLOCK_SHIFT]) ) continue;
+
+			// Corner of block
+			int x0 = (x - minx) << 4;
+			int y0 = (y - miny) << 4;
+
+			// Accept whole block when totally covered
+			if( accept & bit )
+			{
+				// Generate a fragment, or add to the run of blocks before it
+				MSR_FragmentBufferAddBlock(frag_buffer, thread_id, face_idx, x, y);
+			}
+			else 
+			{
+				// Edge functions of the top left stamp
+				__m512i iCY1 = _mm512_add_epi32( _mm512_set1_epi32(C1 + DX12 * y0 - DY12 * x0), iOffset12 );
+				__m512i iCY2 = _mm512_add_epi32( _mm512_set1_epi32(C2 + DX23 * y0 - DY23 * x0), iOffset23 );
+				__m512i iCY3 = _mm512_add_epi32( _mm512_set1_epi32(C3 + DX31 * y0 - DY31 * x0), iOffset31 );
+
+				for(int iy = y; iy < y + q; iy += 4)
+				{
+					__m512i iCX1 = iCY1;
+					__m512i iCX2 = iCY2;
+					__m512i iCX3 = iCY3;
+
+					for(int ix = x; ix < x + q; ix += 4)
+					{
+						// Test all 16 pixels against the three edges
+						__mmask16 mask = _mm512_cmpgt_epi32_mask( iCX1, _mm512_setzero_si512() );
+						mask = _mm512_mask_cmpgt_epi32_mask( mask, iCX2, _mm512_setzero_si512() );
+						mask = _mm512_mask_cmpgt_epi32_mask( mask, iCX3, _mm512_setzero_si512() );
+						if( mask )
+						{
+							MSR_FragmentBufferAdd(frag_buffer, MSR_FRAGMENT_STATE_STAMP_MASK, thread_id, face_idx, ix, iy, mask);
+						}
+
+						iCX1 = _mm512_sub_epi32( iCX1, iFDY12 );
+						iCX2 = _mm512_sub_epi32( iCX2, iFDY23 );
+						iCX3 = _mm512_sub_epi32( iCX3, iFDY31 );
+					}
+
+					iCY1 = _mm512_add_epi32( iCY1, iFDX12 );
+					iCY2 = _mm512_add_epi32( iCY2, iFDX23 );
+					iCY3 = _mm512_add_epi32( iCY3, iFDX31 );
+				}
+			}
+		}
+	}
+}
+
+//
+// Run the shader over the lanes in mask k and pack the colors. An 8-wide shader gets called for
+// each half with anything in it, a 4-wide one for each quarter.
+//
+
+template <int half>
+static __forceinline void ShadeHalf( MSR_DrawState *state, MSR_FShaderParameters8 &params, __m512 w, const __m512 *V, __m512 &r, __m512 &g, __m512 &b )
+{
+	for( Uint32 i=0; i<state->context.num_varyings; i++ )
+		params.varyings[i] = _mm512_extractf32x8_ps( _mm512_mul_ps(w, V[i]), half );
+
+	state->context.FragmentShader8(&params);
+	r = _mm512_insertf32x8( r, params.output.r, half );
+	g = _mm512_insertf32x8( g, params.output.g, half );
+	b = _mm512_insertf32x8( b, params.output.b, half );
+}
+
+template <int quarter>
+static __forceinline void ShadeQuarter( MSR_DrawState *state, MSR_FShaderParameters &params, __m512 w, const __m512 *V, __m512 &r, __m512 &g, __m512 &b )
+{
+	for( Uint32 i=0; i<state->context.num_varyings; i++ )
+		params.varyings[i].f = _mm512_extractf32x4_ps( _mm512_mul_ps(w, V[i]), quarter );
+
+	state->context.FragmentShader(&params);
+	r = _mm512_insertf32x4( r, params.output.r.f, quarter );
+	g = _mm512_insertf32x4( g, params.output.g.f, quarter );
+	b = _mm512_insertf32x4( b, params.output.b.f, quarter );
+}
+
+static __forceinline __m512i ShadeLanes( MSR_DrawState *state, MSR_FShaderParameters8 &params8, MSR_FShaderParameters &params4, 
+										 __m512 W, const __m512 *V, __mmask16 k )
+{
+	__m512 w = _mm512_insertf32x8( _mm512_castps256_ps512( _mm256_rcp_ps( _mm512_castps512_ps256(W) ) ), 
+								   _mm256_rcp_ps( _mm512_extractf32x8_ps(W, 1) ), 1 );
+	__m512 r = _mm512_setzero_ps(), g = r, b = r;
+
+	if( state->context.FragmentShader8 )
+	{
+		if( k & 0x00FF ) ShadeHalf<0>( state, params8, w, V, r, g, b );
+		if( k & 0xFF00 ) ShadeHalf<1>( state, params8, w, V, r, g, b );
+	}
+	else
+	{
+		if( k & 0x000F ) ShadeQuarter<0>( state, params4, w, V, r, g, b );
+		if( k & 0x00F0 ) ShadeQuarter<1>( state, params4, w, V, r, g, b );
+		if( k & 0x0F00 ) ShadeQuarter<2>( state, params4, w, V, r, g, b );
+		if( k & 0xF000 ) ShadeQuarter<3>( state, params4, w, V, r, g, b );
+	}
+
+	// Convert back to 255 range, clamp and pack
+	__m512 fMax = _mm512_set1_ps( 255.0f );
+	__m512i iR = _mm512_cvtps_epi32( _mm512_min_ps( _mm512_mul_ps(r, fMax), fMax ) );
+	__m512i iG = _mm512_cvtps_epi32( _mm512_min_ps( _mm512_mul_ps(g, fMax), fMax ) );
+	__m512i iB = _mm512_cvtps_epi32( _mm512_min_ps( _mm512_mul_ps(b, fMax), fMax ) );
+	return _mm512_or_si512( _mm512_or_si512( _mm512_slli_epi32(iR, 16), _mm512_slli_epi32(iG, 8) ), iB );
+}
+
+//
+// Shade a 4x4 stamp, one row of the frame buffer per quarter of the lanes
+//
+
+template <bool useColorBuffer, bool useZBuffer>
+static __forceinline void ShadeStamp( MSR_DrawState *state, MSR_FShaderParameters8 &params8, MSR_FShaderParameters &params4,
+									  MSR_TransformedFace *face, Uint32 x, Uint32 y, __mmask16 k, __m512 C0, __m512i row, Uint32 cb_pitch, Uint32 db_pitch )
+{
+	Uint32 *colorBuffer = state->target->color_tiles + MSR_TiledOffset(state->target, x, y);
+	float *depthBuffer = NULL;
+	if( useZBuffer ) depthBuffer = state->target->depth_tiles + MSR_TiledOffset(state->target, x, y);
+
+	// Every row starts from its own base, just like a masked quad in the SSE kernel
+	float dxstart = (float)x - face->v0x;
+	__m512 dystart = _mm512_sub_ps( _mm512_cvtepi32_ps( _mm512_add_epi32( _mm512_set1_epi32(y), row ) ), _mm512_set1_ps(face->v0y) );
+
+	__m512 base = _mm512_add_ps( _mm512_set1_ps(face->v0w + face->dw.x * dxstart), _mm512_mul_ps( _mm512_set1_ps(face->dw.y), dystart ) );
+	__m512 W = _mm512_add_ps( base, _mm512_mul_ps( _mm512_set1_ps(face->dw.x), C0 ) );
+
+	if( useZBuffer )
+	{
+		__m512 dq = _mm512_castps128_ps512( _mm_maskz_loadu_ps( (__mmask8)k, depthBuffer ) );
+		dq = _mm512_insertf32x4( dq, _mm_maskz_loadu_ps( (__mmask8)(k >> 4), depthBuffer + db_pitch ), 1 );
+		dq = _mm512_insertf32x4( dq, _mm_maskz_loadu_ps( (__mmask8)(k >> 8), depthBuffer + db_pitch * 2 ), 2 );
+		dq = _mm512_insertf32x4( dq, _mm_maskz_loadu_ps( (__mmask8)(k >> 12), depthBuffer + db_pitch * 3 ), 3 );
+		k = _mm512_mask_cmp_ps_mask( k, W, dq, _CMP_GE_OS );
+
+		// Early reject the stamp if we can
+		if( !k )
+			return;
+	}
+
+	if( useColorBuffer )
+	{
+		__m512 V[MSR_MAX_VARYINGS];
+		for( Uint32 i=0; i<state->context.num_varyings; i++ )
+		{
+			base = _mm512_add_ps( _mm512_set1_ps(face->v0v[i] + face->dv[i].x * dxstart), _mm512_mul_ps( _mm512_set1_ps(face->dv[i].y), dystart ) );
+			V[i] = _mm512_add_ps( base, _mm512_mul_ps( _mm512_set1_ps(face->dv[i].x), C0 ) );
+		}
+
+		__m512i nq = ShadeLanes( state, params8, params4, W, V, k );
+		_mm_mask_storeu_epi32( colorBuffer, (__mmask8)k, _mm512_castsi512_si128(nq) );
+		_mm_mask_storeu_epi32( colorBuffer + cb_pitch, (__mmask8)(k >> 4), _mm512_extracti32x4_epi32(nq, 1) );
+		_mm_mask_storeu_epi32( colorBuffer + cb_pitch * 2, (__mmask8)(k >> 8), _mm512_extracti32x4_epi32(nq, 2) );
+		_mm_mask_storeu_epi32( colorBuffer + cb_pitch * 3, (__mmask8)(k >> 12), _mm512_extracti32x4_epi32(nq, 3) );
+	}
+
+	if( useZBuffer )
+	{
+		_mm_mask_storeu_ps( depthBuffer, (__mmask8)k, _mm512_castps512_ps128(W) );
+		_mm_mask_storeu_ps( depthBuffer + db_pitch, (__mmask8)(k >> 4), _mm512_extractf32x4_ps(W, 1) );
+		_mm_mask_storeu_ps( depthBuffer + db_pitch * 2, (__mmask8)(k >> 8), _mm512_extractf32x4_ps(W, 2) );
+		_mm_mask_storeu_ps( depthBuffer + db_pitch * 3, (__mmask8)(k >> 12), _mm512_extractf32x4_ps(W, 3) );
+	}
+}
+
+//
+// Shade a fully covered 8x8 block, two rows per step. The rows are stepped down one WDY add at a
+// time like in the SSE kernel, or W would round differently.
+//
+
+template <bool useColorBuffer, bool useZBuffer>
+static __forceinline void ShadeBlock( MSR_DrawState *state, MSR_FShaderParameters8 &params8, MSR_FShaderParameters &params4,
+									  MSR_TransformedFace *face, Uint32 bx, Uint32 by, Uint32 cb_pitch, Uint32 db_pitch )
+{
+	__m128 C0 = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+	__m128 C1 = _mm_set_ps1( 4.0f );
+
+	Uint32 *colorBuffer = state->target->color_tiles + MSR_TiledOffset(state->target, bx, by);
+	float *depthBuffer = NULL;
+	if( useZBuffer ) depthBuffer = state->target->depth_tiles + MSR_TiledOffset(state->target, bx, by);
+
+	float dxstart = (float)bx - face->v0x;
+	float dystart = (float)by - face->v0y;
+
+	__m128 dx = _mm_set1_ps(face->dw.x);
+	__m128 base = _mm_set1_ps(face->v0w + face->dw.x * dxstart + face->dw.y * dystart);
+	__m128 W0 = _mm_add_ps( base, _mm_mul_ps( dx, C0 ) );
+	__m128 W1 = _mm_add_ps( W0, _mm_mul_ps( dx, C1 ) );
+	__m256 Wrow = _mm256_insertf128_ps( _mm256_castps128_ps256(W0), W1, 1 );
+	__m512 WDY = _mm512_set1_ps(face->dw.y);
+	__m512 W = _mm512_insertf32x8( _mm512_castps256_ps512(Wrow), _mm256_add_ps( Wrow, _mm512_castps512_ps256(WDY) ), 1 );
+
+	__m512 V[MSR_MAX_VARYINGS], VDY[MSR_MAX_VARYINGS];
+	if( useColorBuffer )
+	{
+		for( Uint32 i=0; i<state->context.num_varyings; i++ )
+		{
+			dx = _mm_set1_ps(face->dv[i].x);
+			base = _mm_set1_ps(face->v0v[i] + face->dv[i].x * dxstart + face->dv[i].y * dystart);
+			__m128 V0 = _mm_add_ps( base, _mm_mul_ps( dx, C0 ) );
+			__m128 V1 = _mm_add_ps( V0, _mm_mul_ps( dx, C1 ) );
+			__m256 Vrow = _mm256_insertf128_ps( _mm256_castps128_ps256(V0), V1, 1 );
+			VDY[i] = _mm512_set1_ps(face->dv[i].y);
+			V[i] = _mm512_insertf32x8( _mm512_castps256_ps512(Vrow), _mm256_add_ps( Vrow, _mm512_castps512_ps256(VDY[i]) ), 1 );
+		}
+	}
+
+	// Farthest depth left in the block
+	__m512 zmin = _mm512_set1_ps(FLT_MAX);
+
+	for( Uint32 y=0; y<8; y+=2 )
+	{
+		__mmask16 k = 0xFFFF;
+		if( useZBuffer )
+		{
+			__m512 dq = _mm512_insertf32x8( _mm512_castps256_ps512( _mm256_loadu_ps(depthBuffer) ), _mm256_loadu_ps(depthBuffer + db_pitch), 1 );
+			k = _mm512_cmp_ps_mask( W, dq, _CMP_GE_OS );
+			zmin = _mm512_min_ps( zmin, _mm512_mask_blend_ps(k, dq, W) );
+		}
+
+		if( k )
+		{
+			if( useColorBuffer )
+			{
+				__m512i nq = ShadeLanes( state, params8, params4, W, V, k );
+				_mm256_mask_storeu_epi32( colorBuffer, (__mmask8)k, _mm512_castsi512_si256(nq) );
+				_mm256_mask_storeu_epi32( colorBuffer + cb_pitch, (__mmask8)(k >> 8), _mm512_extracti32x8_epi32(nq, 1) );
+			}
+
+			if( useZBuffer )
+			{
+				_mm256_mask_storeu_ps( depthBuffer, (__mmask8)k, _mm512_castps512_ps256(W) );
+				_mm256_mask_storeu_ps( depthBuffer + db_pitch, (__mmask8)(k >> 8), _mm512_extractf32x8_ps(W, 1) );
+			}
+		}
+
+		W = _mm512_add_ps( _mm512_add_ps( W, WDY ), WDY );
+		if( useColorBuffer ) 
+		{
+			for( Uint32 i=0; i<state->context.num_varyings; i++ )
+				V[i] = _mm512_add_ps( _mm512_add_ps( V[i], VDY[i] ), VDY[i] );
+			colorBuffer += cb_pitch * 2;
+		}
+		if( useZBuffer ) depthBuffer += db_pitch * 2;
+	}
+
+	if( useZBuffer )
+	{
+		__m256 z8 = _mm256_min_ps( _mm512_castps512_ps256(zmin), _mm512_extractf32x8_ps(zmin, 1) );
+		MSR_HiZStoreBlock( state->target, bx, by, _mm_min_ps( _mm256_castps256_ps128(z8), _mm256_extractf128_ps(z8, 1) ) );
+	}
+}
+
+template <bool useColorBuffer, bool useZBuffer>
+void RenderFragmentsAVX512(MSR_DrawState *state, MSR_FragmentBuffer *fb) 
+{
+	MSR_FShaderParameters8 params8;
+	MSR_SSE_ALIGNED MSR_FShaderParameters params4;
+	params8.globals = &state->context.globals;
+	params4.globals = &state->context.globals;
+
+	// Column and row of each lane in a stamp
+	__m512i lane = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m512i row = _mm512_srli_epi32(lane, 2);
+	__m512 C0 = _mm512_cvtepi32_ps( _mm512_and_si512(lane, _mm512_set1_epi32(3)) );
+
+	// Fragments never leave their tile, so rows are a tile apart
+	Uint32 cb_pitch = MSR_SCREEN_TILE_SIZE;
+	Uint32 db_pitch = MSR_SCREEN_TILE_SIZE;
+
+	for( int elem=0; elem<fb->elements; elem++ )
+	{
+		// Get the next fragment
+		MSR_Fragment *frag = MSR_FragmentBufferGet(fb, elem);
+		MSR_TransformedFace *face = &state->face_buffer[frag->thread_id][frag->face_idx];
+		Uint32 fx = fb->x + frag->x;
+		Uint32 fy = fb->y + frag->y;
+		
+		if( frag->state == MSR_FRAGMENT_STATE_STAMP_MASK )
+		{
+			ShadeStamp<useColorBuffer, useZBuffer>( state, params8, params4, face, fx, fy, frag->mask, C0, row, cb_pitch, db_pitch );
+		}
+		else if( frag->state == MSR_FRAGMENT_STATE_BLOCK )
+		{
+			// A run of blocks to the right
+			for( Uint32 bx=fx; bx <= fx + 8 * frag->mask; bx += 8 )
+				ShadeBlock<useColorBuffer, useZBuffer>( state, params8, params4, face, bx, fy, cb_pitch, db_pitch );
+		}
+		else
+		{
+			for( Uint32 by=fy; by < fy + MSR_SCREEN_TILE_SIZE; by += 8 )
+				for( Uint32 bx=fx; bx < fx + MSR_SCREEN_TILE_SIZE; bx += 8 )
+					ShadeBlock<useColorBuffer, useZBuffer>( state, params8, params4, face, bx, by, cb_pitch, db_pitch );
+		}
+	}
+
+	MSR_FragmentBufferClear(fb);
+}
+
+void PrepareRasterizerAVX512(MSR_DrawState *state)
+{
+	state->RasterizeTriangle = RasterizeTriangleAVX512;
+	state->RasterizeStamp = RasterizeStamp4x4;
+
+	if( state->context.color_enabled )
+	{
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderFragmentsAVX512<true, true>;
+		else
+			state->RenderFragments = RenderFragmentsAVX512<true, false>;
+	}
+	else
+	{
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderFragmentsAVX512<false, true>;
+		else
+			state->RenderFragments = RenderFragmentsAVX512<false, false>;
+	}
+}
\ No newline at end of file
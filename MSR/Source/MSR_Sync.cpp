@@ -0,0 +1,138 @@
+///////////////////////////////////////////////////////////////////////
+//
+// Multithreaded Software Rasterizer
+// Copyright 2010 - 2012 :: Zach Bethel
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License v2
+// as published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include "MSR_Sync.h"
+#include <thread>
+
+#if defined(__linux__)
+	#define MSR_SYNC_FUTEX
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+	#include <limits.h>
+#elif defined(_WIN32) && defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0602
+	#define MSR_SYNC_WAIT_ON_ADDRESS
+	#pragma comment(lib,"Synchronization.lib")
+#else
+	#include <mutex>
+	#include <condition_variable>
+#endif
+
+//
+// Wait buckets. Addresses hash onto a bucket, and the bucket keeps track of how
+// many threads are asleep on it so that a wake with no sleepers is just a load.
+//
+
+struct MSR_SyncBucket {
+	MSR_AtomicU32 waiters;
+
+#if !defined(MSR_SYNC_FUTEX) && !defined(MSR_SYNC_WAIT_ON_ADDRESS)
+	std::mutex lock;
+	std::condition_variable cond;
+#endif
+
+	// Keep buckets on their own cache lines
+	Uint8 pad[64];
+};
+
+static MSR_SyncBucket sync_buckets[MSR_SYNC_BUCKETS];
+
+Uint32 sync_spin_count = MSR_SYNC_SPIN_COUNT;
+
+void MSR_SyncInit( Uint32 num_threads )
+{
+	// hardware_concurrency() may not know, in which case assume we have the cores
+	Uint32 cores = std::thread::hardware_concurrency();
+	sync_spin_count = ( !cores || num_threads <= cores ) ? MSR_SYNC_SPIN_COUNT : 0;
+}
+
+static inline MSR_SyncBucket &GetBucket( MSR_AtomicU32 *addr )
+{
+	size_t key = (size_t)addr;
+	key ^= key >> 6;
+	key ^= key >> 12;
+	return sync_buckets[key & (MSR_SYNC_BUCKETS-1)];
+}
+
+bool MSR_SyncHasWaiters( MSR_AtomicU32 *addr )
+{
+	return GetBucket(addr).waiters.load(std::memory_order_relaxed) != 0;
+}
+
+#if defined(MSR_SYNC_FUTEX)
+
+void MSR_SyncBlock( MSR_AtomicU32 *addr, Uint32 value )
+{
+	MSR_SyncBucket &bucket = GetBucket(addr);
+
+	bucket.waiters.fetch_add(1, std::memory_order_seq_cst);
+	if( addr->load(std::memory_order_seq_cst) == value )
+		syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, (int)value, NULL, NULL, 0);
+	bucket.waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MSR_SyncWakeBlocked( MSR_AtomicU32 *addr )
+{
+	syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#elif defined(MSR_SYNC_WAIT_ON_ADDRESS)
+
+void MSR_SyncBlock( MSR_AtomicU32 *addr, Uint32 value )
+{
+	MSR_SyncBucket &bucket = GetBucket(addr);
+
+	bucket.waiters.fetch_add(1, std::memory_order_seq_cst);
+	if( addr->load(std::memory_order_seq_cst) == value )
+		WaitOnAddress((volatile VOID*)addr, &value, sizeof(Uint32), INFINITE);
+	bucket.waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MSR_SyncWakeBlocked( MSR_AtomicU32 *addr )
+{
+	WakeByAddressAll((PVOID)addr);
+}
+
+#else
+
+void MSR_SyncBlock( MSR_AtomicU32 *addr, Uint32 value )
+{
+	MSR_SyncBucket &bucket = GetBucket(addr);
+
+	std::unique_lock<std::mutex> lock(bucket.lock);
+	bucket.waiters.fetch_add(1, std::memory_order_seq_cst);
+	while( addr->load(std::memory_order_seq_cst) == value )
+		bucket.cond.wait(lock);
+	bucket.waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MSR_SyncWakeBlocked( MSR_AtomicU32 *addr )
+{
+	MSR_SyncBucket &bucket = GetBucket(addr);
+
+	// Taking the lock makes sure a waiter is either fully asleep or has not yet
+	// re-checked the value, so the notify can't be lost in between.
+	{
+		std::lock_guard<std::mutex> lock(bucket.lock);
+	}
+	bucket.cond.notify_all();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,110 @@
+///////////////////////////////////////////////////////////////////////
+//
+// Multithreaded Software Rasterizer
+// Copyright 2010 - 2012 :: Zach Bethel
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License v2
+// as published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//
+///////////////////////////////////////////////////////////////////////
+
+#ifndef MSR_SYNC_H
+#define MSR_SYNC_H
+
+#include "MSR.h"
+#include <atomic>
+
+// D E F I N E S //////////////////////////////////////////////////////
+
+// Number of pause iterations a waiter burns before it blocks in the kernel. This
+// keeps the hand-off latency between pipeline stages in the microsecond range
+// without an idle worker eating a whole core. Spinning is turned off entirely
+// when there are more workers than cores, since then it only steals time from
+// the thread we are waiting on.
+#define MSR_SYNC_SPIN_COUNT			4096
+
+// Number of hashed wait buckets. Each bucket counts its sleepers so that wakers
+// can skip the system call entirely when nobody is blocked.
+#define MSR_SYNC_BUCKETS			64
+
+typedef std::atomic<Uint32> MSR_AtomicU32;
+
+// G L O B A L S //////////////////////////////////////////////////////
+
+extern Uint32 sync_spin_count;
+
+// F U N C T I O N   P R O T O T Y P E S //////////////////////////////
+
+// Slow paths, these go to the kernel (futex, WaitOnAddress or a condition variable).
+MSRAPI void MSR_SyncBlock( MSR_AtomicU32 *addr, Uint32 value );
+MSRAPI void MSR_SyncWakeBlocked( MSR_AtomicU32 *addr );
+MSRAPI bool MSR_SyncHasWaiters( MSR_AtomicU32 *addr );
+
+// Pick the spin budget for the given number of threads
+MSRAPI void MSR_SyncInit( Uint32 num_threads );
+
+// I N L I N E S //////////////////////////////////////////////////////
+
+inline void MSR_SyncPause()
+{
+	_mm_pause();
+}
+
+//
+// Wait for as long as *addr holds value. The load that observes the new value
+// is an acquire, so everything written before the matching store is visible.
+//
+
+inline void MSR_SyncWaitWhile( MSR_AtomicU32 *addr, Uint32 value )
+{
+	for( Uint32 i=0; i<sync_spin_count; i++ ) {
+		if( addr->load(std::memory_order_acquire) != value ) return;
+		MSR_SyncPause();
+	}
+
+	while( addr->load(std::memory_order_acquire) == value )
+		MSR_SyncBlock( addr, value );
+}
+
+//
+// Wait until *addr holds value.
+//
+
+inline void MSR_SyncWaitUntil( MSR_AtomicU32 *addr, Uint32 value )
+{
+	Uint32 curr;
+	while( (curr = addr->load(std::memory_order_acquire)) != value )
+		MSR_SyncWaitWhile( addr, curr );
+}
+
+//
+// Wake everybody waiting on addr. Must be called after the store that changed it.
+//
+
+inline void MSR_SyncWake( MSR_AtomicU32 *addr )
+{
+	// Order the caller's store before the waiter count check. The waiter does the
+	// mirror image (bumps the count, then re-reads the value), so one of us always
+	// sees the other.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if( MSR_SyncHasWaiters(addr) )
+		MSR_SyncWakeBlocked( addr );
+}
+
+inline void MSR_SyncStore( MSR_AtomicU32 *addr, Uint32 value )
+{
+	addr->store(value, std::memory_order_release);
+	MSR_SyncWake( addr );
+}
+
+#endif
\ No newline at end of file
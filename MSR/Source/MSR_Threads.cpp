@@ -20,20 +20,23 @@
 
 #include "MSR_Threads.h"
 #include <time.h>
+#include <malloc.h>
 
 MSR_ThreadRenderData *thread_render_data;
 
-extern Uint32 *vertex_buffer_size;
+MSR_AtomicU32 batches_submitted;
 
-SDL_cond *start_working_cond;
-SDL_cond *end_working_cond;
+// The job each of the last MSR_BATCH_SLOTS batch numbers was handed out with
+static MSR_ThreadRenderData *submitted_jobs[MSR_BATCH_SLOTS];
 
-SDL_mutex *end_working_lock;
-SDL_mutex *threads_working_lock;
-
-volatile Uint32 curr_threads_working;
+MSR_Stats render_stats;
+MSR_ThreadCount *clipped_triangles;
 
 static SDL_Thread **threads;
+static LARGE_INTEGER timer_frequency;
+
+// Set before the last batch number is published, the workers leave instead of picking it up
+static bool threads_quit;
 
 //
 // This is the worker function
@@ -43,67 +46,266 @@ int MSR_WorkFunc(void *data)
 {
 	Uint32 thread_id = (Uint32)data;
 
-	// This is the end state for all work threads (i.e. when a job is done, all threads go to sleep once they finish the pixel processing).
-	// Coincidentally, all work threads are set to this mode on startup, because it is convenient to wake them up by just signaling that vertex
-	// processing has begun.
-	SDL_mutexP(end_working_lock);
-	while( THREAD_STATE_RASTER == thread_render_data->state ) SDL_CondWait(start_working_cond,end_working_lock);
-	SDL_mutexV(end_working_lock);
+	// Batches are taken in the order they were submitted. The submitting thread cannot get more
+	// than MSR_BATCH_SLOTS ahead of us, since it has to wait for us to finish a slot's last batch.
+	for( Uint32 seq=0; ; seq++ ) {
 
-	while(true) {
+		// Go to sleep until the master thread hands out the next batch.
+		MSR_SyncWaitWhile(&batches_submitted, seq);
+		if( threads_quit )
+			break;
 
-		// We have just been signaled to begin the vertex processing stage.
-		vertex_buffer_size[thread_id] = 0;
-		ProcessTrianglesV( thread_id );
+		MSR_ThreadRenderData *trd = submitted_jobs[ seq % MSR_BATCH_SLOTS ];
 
-		// We finished vertex processing, so do an atomic decrement on the number of working threads. 
-		// If we are the last one, prepare the job queue and signal to begin pixel processing.
-		Uint32 new_value = InterlockedDecrement(&curr_threads_working);
-		if( !new_value ) { 
+		if( trd->stages & JOB_STAGE_VERTEX )
+			ProcessTrianglesV( trd, thread_id );
 
-			// Signal other threads to begin rasterization
-			InterlockedExchange(&curr_threads_working, num_work_threads);
-			thread_render_data->state = THREAD_STATE_RASTER;
-			
-		} else
-			while( THREAD_STATE_VERTEX == thread_render_data->state ) Sleep(0);
+		if( trd->stages & JOB_STAGE_RASTER ) {
 
-		// Process pixel pipeline on tiles
-		ProcessTrianglesR( thread_id );
+			// Wait for everybody to finish vertex processing, rasterizing what we can in the meantime.
+			if( trd->stages & JOB_STAGE_VERTEX )
+				MSR_ThreadsVertexBarrier( trd, thread_id, true );
 
-		// Process our fragment data
-		ProcessFragments( thread_id );
+			// Process pixel pipeline on tiles
+			ProcessTrianglesR( trd, thread_id );
 
-		InterlockedDecrement(&curr_threads_working);
+			// Process our fragment data
+			ProcessFragments( trd, thread_id );
+		}
 
-		// We have finished. Since the job is done, go to sleep until the master thread wakes us up again for the next job.
-		SDL_mutexP(end_working_lock);
-		while( THREAD_STATE_RASTER == thread_render_data->state ) SDL_CondWait(start_working_cond,end_working_lock);
-		SDL_mutexV(end_working_lock);
+		QueryPerformanceCounter(&trd->partitions[thread_id].finish_time);
+		MSR_ThreadsFinishJob( trd );
 	}
 
 	return 0;
 }
 
+//
+// Called by every thread once it is out of vertices. The submitting thread passes wait = false
+// and goes back to set up the next batch; it comes back for its share of the raster work in
+// MSR_ThreadsRetireJob.
+//
+
+void MSR_ThreadsVertexBarrier( MSR_ThreadRenderData *trd, Uint32 thread_id, bool wait )
+{
+	Uint32 progress = trd->vertex_progress.fetch_add(1, std::memory_order_seq_cst) + 1;
+	if( progress == num_work_threads ) {
+		QueryPerformanceCounter(&trd->vertex_done_time);
+
+		// Get everybody off the tiles before deciding how to hand them out
+		MSR_SyncWaitUntil(&trd->early_workers, 0);
+
+		BuildTileJobs( trd );
+		MSR_SyncStore(&trd->vertex_progress, num_work_threads + 1);
+		return;
+	}
+
+	// More bins are final now
+	MSR_SyncWake(&trd->vertex_progress);
+
+	if( !wait )
+		return;
+
+	while( progress < num_work_threads ) {
+
+		// The count has to be up before we look at the progress, see the last thread above
+		trd->early_workers.fetch_add(1, std::memory_order_seq_cst);
+		bool worked = false;
+		if( early_raster && trd->vertex_progress.load(std::memory_order_seq_cst) < num_work_threads )
+			worked = ProcessTrianglesEarly( trd, thread_id );
+		if( trd->early_workers.fetch_sub(1, std::memory_order_seq_cst) == 1 )
+			MSR_SyncWake(&trd->early_workers);
+
+		// Nothing left to do until somebody else finishes their vertices
+		if( !worked )
+			MSR_SyncWaitWhile(&trd->vertex_progress, progress);
+		progress = trd->vertex_progress.load(std::memory_order_acquire);
+	}
+
+	MSR_SyncWaitUntil(&trd->vertex_progress, num_work_threads + 1);
+}
+
+void MSR_ThreadsFinishJob( MSR_ThreadRenderData *trd )
+{
+	// The count starts out one above the number of threads. The last thread out drops that
+	// extra reference once it is done with the stats, so nobody can reuse the slot early.
+	if( trd->threads_working.fetch_sub(1, std::memory_order_acq_rel) == 2 ) {
+
+		// We are the last one out, so everybody's finish time is visible. The submitting thread
+		// is off setting up the next batch while the workers finish, so only they are counted.
+		MSR_ThreadRenderPartition *partitions = trd->partitions;
+		LONGLONG first = partitions[1].finish_time.QuadPart;
+		LONGLONG last = first;
+		LONGLONG total = 0;
+		for( Uint32 t=1; t<num_work_threads; t++ ) {
+			first = min( first, partitions[t].finish_time.QuadPart );
+			last = max( last, partitions[t].finish_time.QuadPart );
+			total += partitions[t].finish_time.QuadPart;
+		}
+
+		double freq = (double)timer_frequency.QuadPart;
+		if( trd->stages & JOB_STAGE_RASTER ) {
+			render_stats.batches++;
+			render_stats.tile_jobs += trd->draw.bins->num_jobs;
+			render_stats.split_tiles += trd->split_tiles;
+		}
+		render_stats.tail_time += (double)(last - first) / freq;
+		render_stats.idle_time += (double)(last * (num_work_threads - 1) - total) / freq;
+		if( (trd->stages & JOB_STAGE_VERTEX) && (trd->stages & JOB_STAGE_RASTER) )
+			render_stats.vertex_time += (double)(trd->vertex_done_time.QuadPart - trd->start_time.QuadPart) / freq;
+
+		trd->threads_working.store(0, std::memory_order_release);
+		MSR_SyncWake(&trd->threads_working);
+	}
+}
+
+//
+// Wait for the slot of the next batch to be free and return it
+//
+
+MSR_ThreadRenderData *MSR_ThreadsNextJob()
+{
+	Uint32 slot = batches_submitted.load(std::memory_order_relaxed) % MSR_BATCH_SLOTS;
+	if( submitted_jobs[slot] )
+		MSR_ThreadsRetireJob( submitted_jobs[slot] );
+	return &thread_render_data[slot];
+}
+
+//
+// Hand a job to the workers. The job must not be in flight, and one with only the raster stage
+// must have its tile jobs built already.
+//
+
+void MSR_ThreadsStartJob( MSR_ThreadRenderData *trd )
+{
+	Uint32 seq = batches_submitted.load(std::memory_order_relaxed);
+	submitted_jobs[ seq % MSR_BATCH_SLOTS ] = trd;
+
+	trd->vertex_progress.store( (trd->stages & JOB_STAGE_VERTEX) ? 0 : num_work_threads + 1, std::memory_order_relaxed );
+	QueryPerformanceCounter(&trd->start_time);
+
+	// Signal all worker threads to begin processing immediately.
+	trd->threads_working.store(num_work_threads + 1, std::memory_order_relaxed);
+	MSR_SyncStore(&batches_submitted, seq + 1);
+}
+
+//
+// Do the submitting thread's part of the raster and fragment stages of a batch, then wait for the
+// workers to finish it. Everything a batch slot holds is free for reuse afterwards.
+//
+
+void MSR_ThreadsRetireJob( MSR_ThreadRenderData *trd )
+{
+	// Nothing in flight, or we are already through with it
+	if( !trd->threads_working.load(std::memory_order_acquire) )
+		return;
+
+	if( trd->stages & JOB_STAGE_RASTER ) {
+		MSR_SyncWaitUntil(&trd->vertex_progress, num_work_threads + 1);
+
+		ProcessTrianglesR( trd, 0 );
+		ProcessFragments( trd, 0 );
+	}
+
+	MSR_ThreadsFinishJob( trd );
+	MSR_SyncWaitUntil(&trd->threads_working, 0);
+}
+
+void MSR_ThreadsSync()
+{
+	// Oldest batch first, the newer one may be waiting on its tiles
+	Uint32 seq = batches_submitted.load(std::memory_order_relaxed);
+	for( Uint32 i=MSR_BATCH_SLOTS; i>0; i-- ) {
+		MSR_ThreadRenderData *trd = submitted_jobs[ (seq - i) % MSR_BATCH_SLOTS ];
+		if( trd )
+			MSR_ThreadsRetireJob( trd );
+	}
+}
+
+void MSR_GetStats( MSR_Stats *stats )
+{
+	MSR_ThreadsSync();
+	*stats = render_stats;
+	stats->bin_memory = bin_arena_blocks.load(std::memory_order_relaxed) * sizeof(MSR_BinArenaBlock);
+
+	stats->clipped_triangles = 0;
+	for( Uint32 t=0; t<num_work_threads; t++ )
+		stats->clipped_triangles += clipped_triangles[t].count;
+}
+
+void MSR_ResetStats()
+{
+	MSR_ThreadsSync();
+	ZeroMemory(&render_stats,sizeof(MSR_Stats));
+	for( Uint32 t=0; t<num_work_threads; t++ )
+		clipped_triangles[t].count = 0;
+}
+
+//
+// Set up an idle job
+//
+
+void MSR_InitRenderData( MSR_ThreadRenderData *trd )
+{
+	trd->vertices = NULL;
+	trd->indices = NULL;
+	trd->num_indices = 0;
+	trd->stages = 0;
+	trd->draw_id = 0;
+	trd->draw.target = NULL;
+	trd->draw.bins = NULL;
+	trd->draw.prev_bins = NULL;
+	trd->draws = NULL;
+	trd->chunk_draw = NULL;
+	trd->num_draws = 0;
+	trd->partitions = new MSR_ThreadRenderPartition[num_work_threads];
+	trd->vertex_progress.store(0, std::memory_order_relaxed);
+	trd->early_workers.store(0, std::memory_order_relaxed);
+	trd->threads_working.store(0, std::memory_order_relaxed);
+	trd->split_tiles = 0;
+
+	trd->chunk_size = max( (Uint32)1, min( (Uint32)MSR_VERTEX_CHUNK_SIZE, MSR_VERTEX_BUFFER_SIZE / (6 * num_work_threads) ) );
+	trd->chunk_base = 0;
+	trd->num_chunks = 0;
+	trd->next_chunk.store(0, std::memory_order_relaxed);
+	trd->chunk_owner = new Uint32[MSR_VERTEX_MAX_CHUNKS];
+	trd->chunk_face_end = new Uint32[MSR_VERTEX_MAX_CHUNKS];
+	trd->chunk_done = new MSR_AtomicU32[MSR_VERTEX_MAX_CHUNKS];
+
+	ZeroMemory(trd->partitions,num_work_threads * sizeof(MSR_ThreadRenderPartition));
+}
+
+void MSR_DestroyRenderData( MSR_ThreadRenderData *trd )
+{
+	SAFE_DELETE_ARRAY(trd->partitions);
+	SAFE_DELETE_ARRAY(trd->chunk_owner);
+	SAFE_DELETE_ARRAY(trd->chunk_face_end);
+	SAFE_DELETE_ARRAY(trd->chunk_done);
+}
+
 void MSR_InitWorkerThreads() 
 {
-	thread_render_data = new MSR_ThreadRenderData;
-	thread_render_data->vertices = NULL;
-	thread_render_data->indices = NULL;
-	thread_render_data->partitions = new MSR_ThreadRenderPartition[num_work_threads];
-	thread_render_data->state = THREAD_STATE_RASTER;
-	
-	curr_threads_working = 0;
+	thread_render_data = new MSR_ThreadRenderData[MSR_BATCH_SLOTS];
 
-	ZeroMemory(thread_render_data->partitions,num_work_threads * sizeof(MSR_ThreadRenderPartition));
+	for( Uint32 slot=0; slot<MSR_BATCH_SLOTS; slot++ ) {
+		MSR_InitRenderData( &thread_render_data[slot] );
+		submitted_jobs[slot] = NULL;
+	}
 
-	if( num_work_threads != 1 ) {
-	
-		start_working_cond = SDL_CreateCond();
-		end_working_cond = SDL_CreateCond();
-		end_working_lock = SDL_CreateMutex();
-		threads_working_lock = SDL_CreateMutex();
+	batches_submitted.store(0, std::memory_order_relaxed);
+	threads_quit = false;
+
+	MSR_SyncInit(num_work_threads);
+
+	QueryPerformanceFrequency(&timer_frequency);
+	ZeroMemory(&render_stats,sizeof(MSR_Stats));
+
+	clipped_triangles = (MSR_ThreadCount*)_aligned_malloc(sizeof(MSR_ThreadCount) * num_work_threads, MSR_CACHE_LINE_SIZE);
+	for( Uint32 t=0; t<num_work_threads; t++ )
+		clipped_triangles[t].count = 0;
 
+	threads = NULL;
+	if( num_work_threads != 1 ) {
 		threads = new SDL_Thread*[num_work_threads-1];
 		for( Uint32 t=0;t<num_work_threads-1; t++ ) 
 			threads[t] = SDL_CreateThread(MSR_WorkFunc,(void*)(t+1));
@@ -112,21 +314,27 @@ void MSR_InitWorkerThreads()
 
 void MSR_DestroyWorkerThreads() 
 {
-	if( thread_render_data ) {
-		if( thread_render_data->partitions ) {
-			delete [] thread_render_data->partitions;
-		}
-		delete thread_render_data;
-	}
-		
 	if( num_work_threads != 1 ) {
+
+		// Let the workers run out of their loop rather than killing them while they might hold a lock.
+		MSR_ThreadsSync();
+		threads_quit = true;
+		MSR_SyncStore(&batches_submitted, batches_submitted.load(std::memory_order_relaxed) + 1);
+
 		for( Uint32 t=0;t<num_work_threads-1; t++ )
-			SDL_KillThread(threads[t]);
+			SDL_WaitThread(threads[t], NULL);
+
+		SAFE_DELETE_ARRAY(threads);
+	}
+
+	if( thread_render_data ) {
+		for( Uint32 slot=0; slot<MSR_BATCH_SLOTS; slot++ )
+			MSR_DestroyRenderData( &thread_render_data[slot] );
+		SAFE_DELETE_ARRAY(thread_render_data);
+	}
 
-		if( threads ) delete [] threads;
-		SDL_DestroyMutex(threads_working_lock);
-		SDL_DestroyMutex(end_working_lock);
-		SDL_DestroyCond(start_working_cond);
-		SDL_DestroyCond(end_working_cond);
+	if( clipped_triangles ) {
+		_aligned_free(clipped_triangles);
+		clipped_triangles = NULL;
 	}
 }
\ No newline at end of file
@@ -23,57 +23,122 @@
 
 #include "MSR.h"
 #include "MSR_Render.h"
+#include "MSR_Sync.h"
 
 // D E F I N E S //////////////////////////////////////////////////////
 
-#define THREAD_STATE_VERTEX		0
-#define THREAD_STATE_RASTER		1
+// Pipeline stages a job runs. A deferred frame is binned by vertex-only jobs and drawn by a
+// raster-only one, whose tile jobs are built up front.
+#define JOB_STAGE_VERTEX		0x1
+#define JOB_STAGE_RASTER		0x2
 
 // F U N C T I O N   P R O T O T Y P E S //////////////////////////////
 
-MSRAPI void ProcessTrianglesV( Uint32 thread_id );
-MSRAPI void ProcessTrianglesR( Uint32 thread_id );
-MSRAPI void ProcessFragments( Uint32 thread_id );
+struct MSR_ThreadRenderData;
+
+MSRAPI void ProcessTrianglesV( MSR_ThreadRenderData *trd, Uint32 thread_id );
+MSRAPI void ProcessTrianglesR( MSR_ThreadRenderData *trd, Uint32 thread_id );
+MSRAPI void ProcessFragments( MSR_ThreadRenderData *trd, Uint32 thread_id );
+MSRAPI void BuildTileJobs( MSR_ThreadRenderData *trd );
+MSRAPI bool ProcessTrianglesEarly( MSR_ThreadRenderData *trd, Uint32 thread_id );
 
 MSRAPI void MSR_InitWorkerThreads();
 MSRAPI void MSR_DestroyWorkerThreads();
+MSRAPI void MSR_InitRenderData( MSR_ThreadRenderData *trd );
+MSRAPI void MSR_DestroyRenderData( MSR_ThreadRenderData *trd );
+
+// Job hand-off between the submitting thread and the workers
+MSRAPI MSR_ThreadRenderData *MSR_ThreadsNextJob();
+MSRAPI void MSR_ThreadsStartJob( MSR_ThreadRenderData *trd );
+MSRAPI void MSR_ThreadsVertexBarrier( MSR_ThreadRenderData *trd, Uint32 thread_id, bool wait );
+MSRAPI void MSR_ThreadsFinishJob( MSR_ThreadRenderData *trd );
+MSRAPI void MSR_ThreadsRetireJob( MSR_ThreadRenderData *trd );
+MSRAPI void MSR_ThreadsSync();
+
+// Draw a pending deferred frame, then sync
+MSRAPI void MSR_FlushFrame();
 
 // S T R U C T U R E S ////////////////////////////////////////////////
 
 struct MSR_ThreadRenderPartition {
-	Uint32 start_index;
-	Uint32 end_index;
+
+	// When this thread ran out of work in the current job
+	LARGE_INTEGER finish_time;
 };
 
+//
+// One batch in flight
+//
+
 struct MSR_ThreadRenderData {
 	MSR_Vertex *vertices;
 	Uint32 *indices;
+	Uint32 num_indices;
+
+	// JOB_STAGE_* bits
+	Uint32 stages;
+
+	// Render state, target and buffers of the batch
+	MSR_DrawState draw;
+
+	// A deferred frame keeps the state of every draw in it, and which draw each chunk is from.
+	// NULL for ordinary batches, which only have the one above.
+	MSR_DrawState *draws;
+	Uint32 *chunk_draw;
+	Uint32 num_draws;
+
+	// Draw call the batch came from, the vertex caches are good for as long as this stays the same
+	Uint32 draw_id;
+
+	// Vertex work is handed out in chunks of chunk_size triangles. For every chunk we keep
+	// the thread that took it and the end of its faces in that thread's face buffer, which
+	// is all the raster stage needs to put the bins back into submission order. Chunks of
+	// this job's indices start at chunk_base, which is only nonzero while a deferred frame
+	// is appending to the chunks of the draws before.
+	Uint32 chunk_size;
+	Uint32 chunk_base;
+	Uint32 num_chunks;
+	MSR_AtomicU32 next_chunk;
+	Uint32 *chunk_owner;
+	Uint32 *chunk_face_end;
+	MSR_AtomicU32 *chunk_done;
 
-	volatile Uint32 state;
 	MSR_ThreadRenderPartition *partitions;
+
+	// Threads through the vertex stage in the current job. The last one builds the tile
+	// jobs and bumps it once more to let everybody into the raster stage.
+	MSR_AtomicU32 vertex_progress;
+
+	// Threads rasterizing early bins, the last one through the vertex stage waits for them
+	MSR_AtomicU32 early_workers;
+
+	// Threads that have not finished the job yet, plus one held until the stats are in
+	MSR_AtomicU32 threads_working;
+
+	// Tiles split up by BuildTileJobs, added to the stats when the job is done
+	Uint32 split_tiles;
+
+	// When the job was handed out, and when the last thread got through the vertex stage
+	LARGE_INTEGER start_time;
+	LARGE_INTEGER vertex_done_time;
 };
 
 // G L O B A L S //////////////////////////////////////////////////////
 
-// Tile information
-extern Uint32 num_tiles_x;
-extern Uint32 num_tiles_y;
-extern MSR_Tile *tiles;
+// Thread render data, one per batch slot
+extern MSR_ThreadRenderData *thread_render_data;
+extern Uint32 num_work_threads;
 
-// Job queue
-extern volatile Uint32 job_queue_start_rt;
-extern volatile Uint32 job_queue_start_ft;
-extern volatile Uint32 job_queue_end;
+// Rasterize finished bins during the vertex stage, off with MSR_INIT_NO_EARLY_RASTER to measure what it buys
+extern bool early_raster;
 
-// Thread render data
-extern MSR_ThreadRenderData *thread_render_data;
-extern volatile Uint32 num_work_threads;
-extern volatile Uint32 curr_threads_working;
+// Batches handed to the workers so far. Batch n uses slot n % MSR_BATCH_SLOTS.
+extern MSR_AtomicU32 batches_submitted;
 
-extern SDL_cond *start_working_cond;
-extern SDL_cond *end_working_cond;
+// Load balancing statistics
+extern MSR_Stats render_stats;
 
-extern SDL_mutex *end_working_lock;
-extern SDL_mutex *threads_working_lock;
+// Triangles each thread has clipped, added up when the stats are read
+extern MSR_ThreadCount *clipped_triangles;
 
 #endif
\ No newline at end of file
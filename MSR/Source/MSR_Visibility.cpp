@@ -0,0 +1,283 @@
+///////////////////////////////////////////////////////////////////////
+//
+// Multithreaded Software Rasterizer
+// Copyright 2010 - 2012 :: Zach Bethel 
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License v2
+// as published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//
+///////////////////////////////////////////////////////////////////////
+
+#include "MSR_Render.h"
+#include <float.h>
+
+//
+// Visibility buffer. With MSR_INIT_VISIBILITY_BUFFER the fragments of a deferred frame only go
+// through the depth test, and leave behind the ID of the face that won each pixel. Once a tile
+// job has rasterized every draw, ResolveVisibility shades its pixels from the faces they ended
+// up with, so the fragment shader runs once per pixel however much overdraw there was.
+//
+// Depth is interpolated exactly as in the SSE kernel, so the Z-buffer comes out the same as
+// without the visibility buffer. The varyings are taken straight from the plane equations of
+// the face, which may differ from the stepped values of the other kernels in the last bit.
+//
+
+//
+// Depth test a quad and record the face for the pixels that pass. Returns the depth left in
+// the quad.
+//
+
+template <bool useColorBuffer, bool useZBuffer>
+static __forceinline __m128 WriteQuad( __m128 W, __m128i cover, __m128i id, Uint32 *idBuffer, float *depthBuffer )
+{
+	__m128 dq = W;
+	__m128i m = cover;
+
+	if( useZBuffer )
+	{
+		dq = _mm_load_ps(depthBuffer);
+		m = _mm_and_si128( m, _mm_castps_si128(_mm_cmpge_ps(W, dq)) );
+
+		// Early reject the quad if we can
+		if( !_mm_movemask_ps(_mm_castsi128_ps(m)) )
+			return dq;
+
+		dq = _mm_or_ps( _mm_and_ps(_mm_castsi128_ps(m), W), _mm_andnot_ps(_mm_castsi128_ps(m), dq) );
+		_mm_store_ps(depthBuffer, dq);
+	}
+
+	if( useColorBuffer )
+	{
+		__m128i iq = _mm_load_si128((__m128i*)idBuffer);
+		iq = _mm_or_si128( _mm_and_si128(m, id), _mm_andnot_si128(m, iq) );
+		_mm_store_si128((__m128i*)idBuffer, iq);
+	}
+
+	return dq;
+}
+
+template <bool useColorBuffer, bool useZBuffer>
+static __forceinline void WriteBlock( MSR_DrawState *state, const MSR_TransformedFace *face, __m128i id, Uint32 bx, Uint32 by )
+{
+	MSR_RenderTarget *target = state->target;
+	Uint32 *idBuffer = target->vis_ids + by * target->vis_pitch + bx;
+	float *depthBuffer = NULL;
+	Uint32 db_pitch = 0;
+	if( useZBuffer ) {
+		db_pitch = MSR_SCREEN_TILE_SIZE;
+		depthBuffer = target->depth_tiles + MSR_TiledOffset(target, bx, by);
+	}
+
+	// Same steps as SETUP_VARYINGS and INTERPOLATE_Y in the SSE kernel
+	float dxstart = bx - face->v0x;
+	float dystart = by - face->v0y;
+	__m128 base = _mm_set1_ps(face->v0w + face->dw.x * dxstart + face->dw.y * dystart);
+	__m128 dx = _mm_set1_ps(face->dw.x);
+	__m128 WDY = _mm_set1_ps(face->dw.y);
+	__m128 W0 = _mm_add_ps( base, _mm_mul_ps( dx, _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f ) ) );
+	__m128 W1 = _mm_add_ps( W0, _mm_mul_ps( dx, _mm_set_ps1( 4.0f ) ) );
+
+	__m128i cover = _mm_set1_epi32(-1);
+	__m128 zmin = _mm_set_ps1(FLT_MAX);
+
+	for( Uint32 y=0; y<8; y++ )
+	{
+		zmin = _mm_min_ps( zmin, WriteQuad<useColorBuffer, useZBuffer>(W0, cover, id, idBuffer, depthBuffer) );
+		zmin = _mm_min_ps( zmin, WriteQuad<useColorBuffer, useZBuffer>(W1, cover, id, idBuffer + 4, depthBuffer + 4) );
+
+		W0 = _mm_add_ps(W0, WDY);
+		W1 = _mm_add_ps(W1, WDY);
+		idBuffer += target->vis_pitch;
+		depthBuffer += db_pitch;
+	}
+
+	if( useZBuffer ) MSR_HiZStoreBlock(target, bx, by, zmin);
+}
+
+//
+// Fragment kernel for the raster pass. Only the SSE rasterizer feeds it, so there are no
+// 4x4 stamps.
+//
+
+template <bool useColorBuffer, bool useZBuffer>
+static void RenderVisibility( MSR_DrawState *state, MSR_FragmentBuffer *fb )
+{
+	MSR_RenderTarget *target = state->target;
+	__m128i mask_mask = _mm_set_epi32(8, 4, 2, 1);
+
+	for( int elem=0; elem<fb->elements; elem++ )
+	{
+		MSR_Fragment *frag = MSR_FragmentBufferGet(fb, elem);
+		MSR_TransformedFace *face = &state->face_buffer[frag->thread_id][frag->face_idx];
+		Uint32 fx = fb->x + frag->x;
+		Uint32 fy = fb->y + frag->y;
+		__m128i id = _mm_set1_epi32( MSR_VISIBILITY_ID(state->draw_idx, frag->thread_id, frag->face_idx) );
+
+		if( frag->state == MSR_FRAGMENT_STATE_BLOCK_MASK )
+		{
+			Uint32 *idBuffer = target->vis_ids + fy * target->vis_pitch + fx;
+			float *depthBuffer = NULL;
+			if( useZBuffer ) depthBuffer = target->depth_tiles + MSR_TiledOffset(target, fx, fy);
+
+			float dxstart = (float)fx - face->v0x;
+			float dystart = (float)fy - face->v0y;
+			__m128 base = _mm_set1_ps(face->v0w + face->dw.x * dxstart + face->dw.y * dystart);
+			__m128 W0 = _mm_add_ps( base, _mm_mul_ps( _mm_set1_ps(face->dw.x), _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f ) ) );
+
+			__m128i cover = _mm_cmpgt_epi32( _mm_and_si128( _mm_set1_epi32(frag->mask), mask_mask ), _mm_setzero_si128() );
+			WriteQuad<useColorBuffer, useZBuffer>(W0, cover, id, idBuffer, depthBuffer);
+		}
+		else if( frag->state == MSR_FRAGMENT_STATE_BLOCK )
+		{
+			// A run of blocks to the right
+			for( Uint32 bx=fx; bx <= fx + 8 * frag->mask; bx += 8 )
+				WriteBlock<useColorBuffer, useZBuffer>(state, face, id, bx, fy);
+		}
+		else
+		{
+			for( Uint32 by=fy; by < fy + MSR_SCREEN_TILE_SIZE; by += 8 )
+				for( Uint32 bx=fx; bx < fx + MSR_SCREEN_TILE_SIZE; bx += 8 )
+					WriteBlock<useColorBuffer, useZBuffer>(state, face, id, bx, by);
+		}
+	}
+
+	MSR_FragmentBufferClear(fb);
+}
+
+void PrepareRasterizerVisibility(MSR_DrawState *state)
+{
+	state->RasterizeTriangle = RasterizeTriangleSolid;
+	state->RasterizeStamp = RasterizeStamp;
+
+	if( state->context.color_enabled )
+	{
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderVisibility<true, true>;
+		else
+			state->RenderFragments = RenderVisibility<true, false>;
+	}
+	else
+	{
+		if( state->context.depth_enabled )
+			state->RenderFragments = RenderVisibility<false, true>;
+		else
+			state->RenderFragments = RenderVisibility<false, false>;
+	}
+}
+
+//
+// Interpolate the varyings of a face over a quad, into the lanes of params set in m. The
+// first face of a quad fills every lane, the way the other kernels extrapolate a face over
+// the pixels it does not cover.
+//
+
+static __forceinline void InterpolateFace( const MSR_DrawState *state, const MSR_TransformedFace *face, Uint32 x, Uint32 y, __m128 m, bool first, MSR_FShaderParameters &params )
+{
+	__m128 C0 = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+
+	float dxstart = (float)x - face->v0x;
+	float dystart = (float)y - face->v0y;
+	__m128 base = _mm_set1_ps(face->v0w + face->dw.x * dxstart + face->dw.y * dystart);
+	__m128 InvW = _mm_rcp_ps( _mm_add_ps( base, _mm_mul_ps( _mm_set1_ps(face->dw.x), C0 ) ) );
+
+	for( Uint32 i=0; i<state->context.num_varyings; i++ )
+	{
+		__m128 dx = _mm_mul_ps( _mm_set1_ps(face->dv[i].x), C0 );
+		base = _mm_set1_ps(face->v0v[i] + face->dv[i].x * dxstart + face->dv[i].y * dystart);
+		__m128 v = _mm_mul_ps( _mm_add_ps( base, dx ), InvW );
+		params.varyings[i].f = first ? v : _mm_or_ps( _mm_and_ps(m, v), _mm_andnot_ps(m, params.varyings[i].f) );
+	}
+}
+
+//
+// Shade the pixels of a tile job with the faces the raster pass left in the visibility buffer,
+// and empty it for the next frame. The pixels of a quad that show the same draw are shaded
+// together, each with the varyings of its own face, so a quad usually runs the fragment
+// shader once even where small faces meet.
+//
+
+void ResolveVisibility( MSR_DrawState *draws, const MSR_TileJob &job )
+{
+	MSR_RenderTarget *target = draws[0].target;
+
+	MSR_SSE_ALIGNED MSR_FShaderParameters params;
+
+	__m128 fMax = _mm_set_ps1( 255.0f );
+	__m128i none = _mm_set1_epi32( MSR_VISIBILITY_NONE );
+	__m128i mask_mask = _mm_set_epi32(8, 4, 2, 1);
+
+	Uint32 x_last = job.x + job.width;
+
+	for( Uint32 y=job.y; y<=(Uint32)job.y+job.height; y++ )
+	{
+		Uint32 *idLine = target->vis_ids + y * target->vis_pitch;
+		// Jobs never leave their tile, so the row of colour is whole in the tiled buffer
+		Uint32 *colorLine = target->color_tiles + MSR_TiledOffset(target, job.x & ~(MSR_SCREEN_TILE_SIZE - 1), y);
+
+		for( Uint32 x=job.x; x<=x_last; x+=4 )
+		{
+			__m128i ids = _mm_load_si128((__m128i*)&idLine[x]);
+			Uint32 live = ~_mm_movemask_ps( _mm_castsi128_ps(_mm_cmpeq_epi32(ids, none)) ) & 0xF;
+
+			// Pixels past the edge of the target are never shaded
+			if( x + 3 > x_last )
+				live &= ( 1 << (x_last - x + 1) ) - 1;
+			if( !live )
+				continue;
+
+			__m128i quad = _mm_load_si128((__m128i*)&colorLine[x & (MSR_SCREEN_TILE_SIZE - 1)]);
+			__m128i quad_draws = _mm_srli_epi32(ids, 24);
+
+			for( Uint32 lane=0; live; lane++ )
+			{
+				if( !( live & (1 << lane) ) )
+					continue;
+
+				// Every pixel of the quad left with this draw
+				Uint32 draw = MSR_VISIBILITY_DRAW(idLine[x + lane]);
+				Uint32 same = _mm_movemask_ps( _mm_castsi128_ps(_mm_cmpeq_epi32(quad_draws, _mm_set1_epi32(draw))) ) & live;
+				live &= ~same;
+
+				// and the faces they show
+				MSR_DrawState *state = &draws[draw];
+				Uint32 todo = same;
+				for( Uint32 face_lane=lane; todo; face_lane++ )
+				{
+					if( !( todo & (1 << face_lane) ) )
+						continue;
+
+					Uint32 id = idLine[x + face_lane];
+					__m128 m = _mm_castsi128_ps( _mm_cmpeq_epi32(ids, _mm_set1_epi32(id)) );
+					MSR_TransformedFace *face = &state->face_buffer[ MSR_VISIBILITY_THREAD(id) ][ MSR_VISIBILITY_FACE(id) ];
+					InterpolateFace(state, face, x, y, m, todo == same, params);
+					todo &= ~_mm_movemask_ps(m);
+				}
+
+				params.globals = &state->context.globals;
+				state->context.FragmentShader(&params);
+
+				// Convert back to 255 range, clamp and pack
+				__m128i iR = _mm_cvtps_epi32( _mm_min_ps( _mm_mul_ps(params.output.r.f, fMax), fMax ) );
+				__m128i iG = _mm_cvtps_epi32( _mm_min_ps( _mm_mul_ps(params.output.g.f, fMax), fMax ) );
+				__m128i iB = _mm_cvtps_epi32( _mm_min_ps( _mm_mul_ps(params.output.b.f, fMax), fMax ) );
+				__m128i nquad = _mm_or_si128( _mm_or_si128( _mm_slli_epi32(iR, 16), _mm_slli_epi32(iG, 8) ), iB );
+
+				__m128i m = _mm_cmpgt_epi32( _mm_and_si128( _mm_set1_epi32(same), mask_mask ), _mm_setzero_si128() );
+				quad = _mm_or_si128( _mm_and_si128(m, nquad), _mm_andnot_si128(m, quad) );
+			}
+
+			_mm_store_si128((__m128i*)&colorLine[x & (MSR_SCREEN_TILE_SIZE - 1)], quad);
+			_mm_store_si128((__m128i*)&idLine[x], none);
+		}
+	}
+}
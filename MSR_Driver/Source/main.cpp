@@ -19,6 +19,8 @@
 ///////////////////////////////////////////////////////////////////////
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
 #include <MSR.h>
 #include <MSR_Math.h>
 #include <MSR_Shader.h>
@@ -246,7 +248,16 @@ int main( int argc, char* argv[] )
 	if( argc >= 9 ) shadow_map_size = atoi( argv[8] );
 	shadow_map = SDL_CreateRGBSurface(SDL_SWSURFACE, shadow_map_size, shadow_map_size, 16, 0, 0, 0, 0);
 
-	if( MSR_Init(screen, MSR_INIT_ZBUFFER, num_threads ) != 0 ) return 4;
+	Uint32 init_flags = MSR_INIT_ZBUFFER;
+	if( argc >= 10 && atoi( argv[9] ) ) init_flags |= MSR_INIT_FUSED_TILES;
+	if( argc >= 11 && atoi( argv[10] ) ) init_flags |= MSR_INIT_DEFERRED_FRAME;
+	if( argc >= 13 && atoi( argv[12] ) ) init_flags |= MSR_INIT_UNSORTED_JOBS;
+	if( argc >= 14 && atoi( argv[13] ) ) init_flags |= MSR_INIT_ASYNC_DRAWS;
+	if( argc >= 15 && atoi( argv[14] ) ) init_flags |= MSR_INIT_VISIBILITY_BUFFER;
+	if( argc >= 16 && atoi( argv[15] ) ) init_flags |= MSR_INIT_NO_TILE_SPLIT;
+	if( argc >= 17 && atoi( argv[16] ) ) init_flags |= MSR_INIT_NO_EARLY_RASTER;
+
+	if( MSR_Init(screen, init_flags, num_threads ) != 0 ) return 4;
 
 	Uint32 shadow_map_id = 0;
 	MSR_CreateRenderTarget(shadow_map, MSR_INIT_ZBUFFER, &shadow_map_id);
@@ -262,6 +273,14 @@ int main( int argc, char* argv[] )
 		mesh_scale = MSR_Vec3( 1.0f, 1.0f, 1.0f );
 	}
 
+	// Benchmark: draw this many frames from a fixed camera, print the averages and the 99th
+	// percentile frame time, then quit. Run it at different thread counts to see how the stages scale.
+	int bench_frames = 0;
+	if( argc >= 12 ) bench_frames = atoi( argv[11] );
+	int bench_count = 0;
+	StopWatch bench_sw, bench_frame_sw;
+	vector<double> bench_times;
+
 	bool first_frame = true;
 	float fps = 0.0f;
 	float t = 0.0f;
@@ -288,7 +307,8 @@ int main( int argc, char* argv[] )
 		}	
 
 		MSR_SetLight(&l, 0);
-		handle_input(sw.getElapsedTime());
+		if( !bench_frames )
+			handle_input(sw.getElapsedTime());
 		update_camera();
 
 		if( !first_frame && world_dirty )
@@ -331,6 +351,37 @@ int main( int argc, char* argv[] )
 		MSR_EndScene();
 		if( !first_frame ) MSR_Present();
 
+		if( bench_frames )
+		{
+			// The first frame goes without the shadow map and the second draws it, leave both out
+			first_frame = false;
+			bench_count++;
+			if( bench_count > 2 ) {
+				bench_frame_sw.stopTimer();
+				bench_times.push_back( bench_frame_sw.getElapsedTime() );
+			}
+			bench_frame_sw.startTimer();
+
+			if( bench_count == 2 ) {
+				MSR_ResetStats();
+				bench_sw.startTimer();
+			}
+			else if( bench_count == bench_frames + 2 ) {
+				MSR_Stats stats;
+				MSR_GetStats(&stats);
+				bench_sw.stopTimer();
+				sort( bench_times.begin(), bench_times.end() );
+				cout << num_threads << " threads"
+					 << "  Frame: " << 1000.0 * bench_sw.getElapsedTime() / bench_frames << " ms"
+					 << "  p99: " << 1000.0 * bench_times[ (bench_times.size() * 99) / 100 ] << " ms"
+					 << "  Vertex: " << 1000.0 * stats.vertex_time / bench_frames << " ms"
+					 << "  Tail: " << 1000.0 * stats.tail_time / bench_frames << " ms"
+					 << "  Idle: " << 1000.0 * stats.idle_time / bench_frames << " ms\n";
+				quitting = true;
+			}
+			continue;
+		}
+
 		frames++;
 		fps += 1.0 / sw.getElapsedTime();
 		t += sw.getElapsedTime();
@@ -338,8 +389,14 @@ int main( int argc, char* argv[] )
 		{
 			if( first_frame ) 
 				first_frame = false;
-			else 
-				cout << "FPS: " << fps / frames << "\n";
+			else {
+				MSR_Stats stats;
+				MSR_GetStats(&stats);
+				cout << "FPS: " << fps / frames
+					 << "  Tail: " << 1000.0 * stats.tail_time / frames << " ms"
+					 << "  Idle: " << 1000.0 * stats.idle_time / frames << " ms\n";
+			}
+			MSR_ResetStats();
 
 			frames = 0;
 			fps = 0.0f;
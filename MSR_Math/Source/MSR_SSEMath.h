@@ -46,7 +46,9 @@ typedef MSR_SSEVec4 MSR_SSEColor4;
 MSR_SSE_ALIGNED class MSR_SSEFloat
 {
 public:
-	MSR_SSEFloat() {}
+	// Defaulted so the constructors stay trivial. A user-provided one is emitted into every unit
+	// that builds shader parameters, the AVX2 and AVX-512 ones included, and the linker keeps one copy.
+	MSR_SSEFloat() = default;
 	MSR_SSEFloat(const __m128 &ps);
 	MSR_SSEFloat(float ss);
 	MSR_SSEFloat(float A, float B, float C, float D);
@@ -88,7 +90,7 @@ public:
 class MSR_SSEVec2
 {
 public:
-	MSR_SSEVec2() {}
+	MSR_SSEVec2() = default;
 	MSR_SSEVec2(const MSR_SSEFloat &x, const MSR_SSEFloat &y);
 
 	// Functions
@@ -137,7 +139,7 @@ public:
 class MSR_SSEVec3
 {
 public:
-	MSR_SSEVec3() {}
+	MSR_SSEVec3() = default;
 	MSR_SSEVec3(const MSR_SSEFloat &x, const MSR_SSEFloat &y, const MSR_SSEFloat &z);
 
 	// Functions
@@ -199,7 +201,7 @@ public:
 class MSR_SSEVec4
 {
 public:
-	MSR_SSEVec4() {}
+	MSR_SSEVec4() = default;
 	MSR_SSEVec4(const MSR_SSEFloat &x, const MSR_SSEFloat &y, const MSR_SSEFloat &z, const MSR_SSEFloat &w);
 
 	// Functions